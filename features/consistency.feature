@@ -6,6 +6,9 @@ Scenario Outline: conversions to various outputs will produce exactly the same i
     when the <image> is converted by the code to <file_type>
     then the <converted_image> has the right <md5> hash value
 
+# The RAW and JPG outputs are the data of the section, after its
+# header, followed by as many zero bytes as the header is long (28),
+# so that they are as long as the section.
 Examples: images
 | image | file_type | converted_image | md5 |
 | x3f_test_files/_SDI8040.X3F | DNG | x3f_test_files/_SDI8040.X3F.dng | efa34925dd4e4425726da74cbae9955b |
@@ -0,0 +1,120 @@
+/* X3F_ARENA.C
+ *
+ * Library for allocating memory that is released all at once.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (64*1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(S) (((S) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct x3f_arena_block_s {
+  x3f_arena_block_t *next;
+  size_t size;
+  size_t used;
+};
+
+/* The memory of a block starts after the aligned header */
+#define BLOCK_HEADER ARENA_ROUND(sizeof(x3f_arena_block_t))
+
+/* extern */ void *x3f_arena_alloc(x3f_arena_t *A, size_t size)
+{
+  x3f_arena_block_t *B = A->block;
+  void *p;
+
+  size = ARENA_ROUND(size > 0 ? size : 1);
+
+  if (B == NULL || B->size - B->used < size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE/4 ? size : ARENA_BLOCK_SIZE;
+    x3f_arena_block_t *N;
+
+    if (block_size == ARENA_BLOCK_SIZE && A->spare != NULL) {
+      N = A->spare;
+      A->spare = N->next;
+    } else {
+      N = (x3f_arena_block_t *)malloc(BLOCK_HEADER + block_size);
+      if (N == NULL) return NULL;
+      N->size = block_size;
+    }
+
+    N->used = 0;
+
+    /* A large allocation gets a block of its own, which is put after
+       the current one, so that the rest of that is still used */
+    if (B != NULL && block_size != ARENA_BLOCK_SIZE) {
+      N->next = B->next;
+      B->next = N;
+    } else {
+      N->next = B;
+      A->block = N;
+    }
+    B = N;
+  }
+
+  p = (char *)B + BLOCK_HEADER + B->used;
+  B->used += size;
+  memset(p, 0, size);
+
+  return p;
+}
+
+static void free_blocks(x3f_arena_block_t *B)
+{
+  while (B != NULL) {
+    x3f_arena_block_t *next = B->next;
+
+    free(B);
+    B = next;
+  }
+}
+
+/* extern */ void x3f_arena_reset(x3f_arena_t *A)
+{
+  x3f_arena_block_t *B = A->block;
+
+  while (B != NULL) {
+    x3f_arena_block_t *next = B->next;
+
+    /* Blocks of large allocations are unlikely to fit the next ones */
+    if (B->size == ARENA_BLOCK_SIZE) {
+      B->next = A->spare;
+      A->spare = B;
+    } else
+      free(B);
+    B = next;
+  }
+
+  A->block = NULL;
+}
+
+/* extern */ void x3f_arena_move_spare(x3f_arena_t *to, x3f_arena_t *from)
+{
+  x3f_arena_block_t *B = from->spare;
+
+  while (B != NULL) {
+    x3f_arena_block_t *next = B->next;
+
+    B->next = to->spare;
+    to->spare = B;
+    B = next;
+  }
+
+  from->spare = NULL;
+}
+
+/* extern */ void x3f_arena_free(x3f_arena_t *A)
+{
+  free_blocks(A->block);
+  free_blocks(A->spare);
+
+  A->block = NULL;
+  A->spare = NULL;
+}
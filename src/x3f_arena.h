@@ -0,0 +1,46 @@
+/* X3F_ARENA.H
+ *
+ * Library for allocating memory that is released all at once.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#ifndef X3F_ARENA_H
+#define X3F_ARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct x3f_arena_block_s x3f_arena_block_t;
+
+/* An arena is empty when all zero. It is not thread safe. */
+typedef struct x3f_arena_s {
+  x3f_arena_block_t *block;	/* The block allocated from, first */
+  x3f_arena_block_t *spare;	/* Released blocks, used again first */
+} x3f_arena_t;
+
+/* Allocate size bytes, set to zero. The memory is suitably aligned
+   for any type. Returns NULL if out of memory. */
+extern void *x3f_arena_alloc(x3f_arena_t *A, size_t size);
+
+/* Release all memory allocated from the arena, but keep the blocks of
+   the standard size as spare blocks for later allocations */
+extern void x3f_arena_reset(x3f_arena_t *A);
+
+/* Move the spare blocks of from to to */
+extern void x3f_arena_move_spare(x3f_arena_t *to, x3f_arena_t *from);
+
+/* Release all memory allocated from the arena, and its spare blocks.
+   The arena is then empty. */
+extern void x3f_arena_free(x3f_arena_t *A);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
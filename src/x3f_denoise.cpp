@@ -54,7 +54,7 @@ static void denoise_nlm(Mat& img, float h)
 
 void x3f_denoise(x3f_area16_t *image, x3f_denoise_type_t type)
 {
-  assert(image->channels == 3);
+  assert(image->channels == 3 && image->plane_stride == 0);
   assert(type < sizeof(denoise_types)/sizeof(denoise_desc_t));
   const denoise_desc_t *d = &denoise_types[type];
 
@@ -74,7 +74,7 @@ void x3f_expand_quattro(x3f_area16_t *image, x3f_area16_t *active,
 			x3f_area16_t *qtop,
 			x3f_area16_t *expanded, x3f_area16_t *active_exp)
 {
-  assert(image->channels == 3);
+  assert(image->channels == 3 && image->plane_stride == 0);
   assert(qtop->channels == 1);
   assert(X3F_DENOISE_F23 < sizeof(denoise_types)/sizeof(denoise_desc_t));
   const denoise_desc_t *d = &denoise_types[X3F_DENOISE_F23];
@@ -19,6 +19,7 @@
 #include "x3f_dump.h"
 #include "x3f_denoise.h"
 #include "x3f_printf.h"
+#include "x3f_thread.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,7 +33,8 @@ typedef enum
     DNG       = 4,
     PPMP3     = 5,
     PPMP6     = 6,
-    HISTOGRAM = 7}
+    HISTOGRAM = 7,
+    PROBE     = 8}
   output_file_type_t;
 
 static char *extension[] =
@@ -43,7 +45,8 @@ static char *extension[] =
     ".dng",
     ".ppm",
     ".ppm",
-    ".csv" };
+    ".csv",
+    "" };
 
 static void usage(char *progname)
 {
@@ -63,6 +66,8 @@ static void usage(char *progname)
           "   -ppm            Dump RAW/color as 3x16 bit PPM/P6 (binary)\n"
           "   -histogram      Dump histogram as csv file\n"
           "   -loghist        Dump histogram as csv file, with log exposure\n"
+          "   -probe          Print a line of header and directory data\n"
+          "                   per file on stdout, without reading the rest\n"
 	  "APPROPRIATE COMBINATIONS OF MODIFIER SWITCHES\n"
 	  "   -color <COLOR>  Convert to RGB color space\n"
 	  "                   (none, sRGB, AdobeRGB, ProPhotoRGB)\n"
@@ -79,11 +84,20 @@ static void usage(char *progname)
           "   -wb <WB>        Select white balance preset\n"
           "   -compress       Enable ZIP compression for DNG and TIFF output\n"
           "   -ocl            Use OpenCL\n"
+          "   -threads <N>    Use at most N threads for decoding\n"
+          "                   NOTE: If not given, one per CPU\n"
+          "   -index          Read and write a decoding index for the RAW\n"
+          "                   NOTE: Makes later decoding of TRUE RAW faster\n"
+          "   -planar         Decode TRUE RAW into separate color planes\n"
+          "                   NOTE: Only faster with -no-denoise or -unprocessed,\n"
+          "                   and not for Quattro, as the planes are otherwise\n"
+          "                   interleaved again before processing\n"
 	  "\n"
 	  "STRANGE STUFF\n"
           "   -offset <OFF>   Offset for SD14 and older\n"
           "                   NOTE: If not given, then offset is automatic\n"
-          "   -matrixmax <M>  Max num matrix elements in metadata (def=100)\n",
+          "   -matrixmax <M>  Max num matrix elements in metadata (def=100)\n"
+          "   -no-mmap        Read the input files instead of mapping them\n",
           progname);
   exit(1);
 }
@@ -190,7 +204,9 @@ int main(int argc, char *argv[])
   char *wb = NULL;
   int compress = 0;
   int use_opencl = 0;
+  int use_index = 0;
   char *outdir = NULL;
+  x3f_decoder_t *decoder;
   x3f_return_t ret;
 
   int i;
@@ -222,6 +238,8 @@ int main(int argc, char *argv[])
       Z, extract_raw = 1, file_type = HISTOGRAM;
     else if (!strcmp(argv[i], "-loghist"))
       Z, extract_raw = 1, file_type = HISTOGRAM, log_hist = 1;
+    else if (!strcmp(argv[i], "-probe"))
+      Z, file_type = PROBE;
 
     else if (!strcmp(argv[i], "-color") && (i+1)<argc) {
       char *encoding = argv[++i];
@@ -264,12 +282,20 @@ int main(int argc, char *argv[])
       compress = 1;
     else if (!strcmp(argv[i], "-ocl"))
       use_opencl = 1;
+    else if ((!strcmp(argv[i], "-threads")) && (i+1)<argc)
+      x3f_max_threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-index"))
+      use_index = 1;
+    else if (!strcmp(argv[i], "-planar"))
+      true_planar = 1;
 
   /* Strange Stuff */
     else if ((!strcmp(argv[i], "-offset")) && (i+1)<argc)
       legacy_offset = atoi(argv[++i]), auto_legacy_offset = 0;
     else if ((!strcmp(argv[i], "-matrixmax")) && (i+1)<argc)
       max_printed_matrix_elements = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-no-mmap"))
+      use_mmap = 0;
     else if (!strncmp(argv[i], "-", 1))
       usage(argv[0]);
     else
@@ -288,6 +314,9 @@ int main(int argc, char *argv[])
     (extract_raw &&
      (crop || (color_encoding != UNPROCESSED && color_encoding != QTOP)));
 
+  /* Buffers are kept from file to file, as the sizes mostly repeat */
+  decoder = x3f_new_decoder();
+
   for (; i<argc; i++) {
     char *infile = argv[i];
     FILE *f_in = fopen(infile, "rb");
@@ -295,6 +324,7 @@ int main(int argc, char *argv[])
 
     char tmpfile[MAXTMPPATH+1];
     char outfile[MAXOUTPATH+1];
+    char indexfile[MAXOUTPATH+1];
     x3f_return_t ret_dump;
     int sgain;
 
@@ -305,6 +335,17 @@ int main(int argc, char *argv[])
       goto found_error;
     }
 
+    if (file_type == PROBE) {
+      x3f_probe_t probe;
+
+      if (x3f_probe(f_in, &probe) != X3F_OK) {
+	x3f_printf(ERR, "Could not probe infile %s\n", infile);
+	goto found_error;
+      }
+      x3f_print_probe(stdout, infile, &probe);
+      goto clean_up;
+    }
+
     x3f_printf(INFO, "READ THE X3F FILE %s\n", infile);
     x3f = x3f_new_from_file(f_in);
 
@@ -313,12 +354,28 @@ int main(int argc, char *argv[])
       goto found_error;
     }
 
-    if (extract_jpg) {
-      if (X3F_OK != (ret = x3f_load_data(x3f, x3f_get_thumb_jpeg(x3f)))) {
-	x3f_printf(ERR, "Could not load JPEG thumbnail from %s (%s)\n",
-		   infile, x3f_err(ret));
-	goto found_error;
+    x3f_use_decoder(x3f, decoder);
+
+    {
+      /* Read the data of all needed sections at once */
+      x3f_directory_entry_t *DE[4];
+      int num = 0;
+
+      if (extract_meta) {
+	DE[num++] = x3f_get_camf(x3f);
+	DE[num++] = x3f_get_prop(x3f);
       }
+      if (extract_raw)
+	DE[num++] = x3f_get_raw(x3f);
+
+      x3f_read_sections(x3f, DE, num);
+    }
+
+    /* The JPEG and the unconverted RAW data are copied straight from
+       the file when dumped, and are therefore never loaded */
+    if (extract_jpg && x3f_get_thumb_jpeg(x3f) == NULL) {
+      x3f_printf(ERR, "Could not find any JPEG thumbnail in %s\n", infile);
+      goto found_error;
     }
 
     if (extract_meta) {
@@ -341,32 +398,46 @@ int main(int argc, char *argv[])
 
     if (extract_raw) {
       x3f_directory_entry_t *DE;
+      uint32_t planes;
 
       if (NULL == (DE = x3f_get_raw(x3f))) {
 	x3f_printf(ERR, "Could not find any matching RAW format\n");
 	goto found_error;
       }
 
-      if (X3F_OK != (ret = x3f_load_data(x3f, DE))) {
-	x3f_printf(ERR, "Could not load RAW from %s (%s)\n",
-		   infile, x3f_err(ret));
-	goto found_error;
+      if (use_index) {
+	if (make_paths(infile, outdir, ".x3fidx", tmpfile, indexfile)) {
+	  x3f_printf(ERR, "Too large index path for infile %s and outdir %s\n",
+		     infile, outdir);
+	  goto found_error;
+	}
+	if (X3F_OK == x3f_load_true_index(x3f, DE, indexfile))
+	  x3f_printf(INFO, "Read index from %s\n", indexfile);
       }
-    }
 
-    if (extract_unconverted_raw) {
-      x3f_directory_entry_t *DE;
+      /* The dark areas are summed up while decoding, if they are
+	 going to be used for preprocessing */
+      if (file_type == DNG ||
+	  (color_encoding != UNPROCESSED && color_encoding != QTOP))
+	x3f_collect_black_level(x3f);
 
-      if (NULL == (DE = x3f_get_raw(x3f))) {
-	x3f_printf(ERR, "Could not find any matching RAW format\n");
-	goto found_error;
-      }
+      /* Only the Quattro top layer is dumped with -qtop */
+      planes = file_type != DNG && color_encoding == QTOP ?
+	X3F_PLANE(2) : X3F_PLANES_ALL;
 
-      if (X3F_OK != (ret = x3f_load_image_block(x3f, DE))) {
-	x3f_printf(ERR, "Could not load unconverted RAW from %s (%s)\n",
+      if (X3F_OK != (ret = x3f_load_image_planes(x3f, DE, NULL, planes))) {
+	x3f_printf(ERR, "Could not load RAW from %s (%s)\n",
 		   infile, x3f_err(ret));
 	goto found_error;
       }
+
+      if (use_index && X3F_OK == x3f_save_true_index(x3f, DE, indexfile))
+	x3f_printf(INFO, "Wrote index to %s\n", indexfile);
+    }
+
+    if (extract_unconverted_raw && x3f_get_raw(x3f) == NULL) {
+      x3f_printf(ERR, "Could not find any matching RAW format\n");
+      goto found_error;
     }
 
     if (make_paths(infile, outdir, extension[file_type], tmpfile, outfile)) {
@@ -424,6 +495,9 @@ int main(int argc, char *argv[])
 						crop, fix_bad, denoise, sgain, wb,
 						log_hist);
       break;
+    case PROBE:
+      /* Handled above, without reading the file */
+      break;
     }
 
     if (X3F_OK != ret_dump) {
@@ -450,6 +524,8 @@ int main(int argc, char *argv[])
       fclose(f_in);
   }
 
+  x3f_delete_decoder(decoder);
+
   if (files == 0) {
     x3f_printf(ERR, "No files given\n");
     usage(argv[0]);
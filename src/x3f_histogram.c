@@ -70,8 +70,7 @@ x3f_return_t x3f_dump_raw_data_as_histogram(x3f_t *x3f,
 
     for (col=0; col < image.columns; col++)
       for (color=0; color < 3; color++) {
-	uint16_t val =
-	  image.data[image.row_stride*row + image.channels*col + color];
+	uint16_t val = X3F_AREA_PIXEL(&image, row, col, color);
 
 	if (log_hist)
 	  val = ilog(val, BASE, STEPS);
@@ -13,6 +13,8 @@
 #include "x3f_printf.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 /* extern */ int x3f_image_area(x3f_t *x3f, x3f_area16_t *image)
@@ -71,16 +73,74 @@
   if (coord[2] >= image->columns || coord[3] >= image->rows) return 0;
 
   crop->data =
-    image->data + image->channels*coord[0] + image->row_stride*coord[1];
+    image->data + X3F_PIXEL_STRIDE(image)*coord[0] +
+    image->row_stride*coord[1];
   crop->columns = coord[2] - coord[0] + 1;
   crop->rows = coord[3] - coord[1] + 1;
   crop->channels = image->channels;
   crop->row_stride = image->row_stride;
+  crop->plane_stride = image->plane_stride;
   crop->buf = image->buf;
 
   return 1;
 }
 
+/* Returns row of area with its channels interleaved. For a planar
+   area, the row is copied to buf, which must hold columns*channels
+   values. */
+/* extern */ uint16_t *x3f_area_row(x3f_area16_t *area, uint32_t row,
+				    uint16_t *buf)
+{
+  uint16_t *src = area->data + area->row_stride*row;
+  uint32_t col, color;
+
+  if (!area->plane_stride) return src;
+
+  for (color = 0; color < area->channels; color++) {
+    uint16_t *plane = src + area->plane_stride*color;
+
+    for (col = 0; col < area->columns; col++)
+      buf[area->channels*col + color] = plane[col];
+  }
+
+  return buf;
+}
+
+/* Converts a planar RAW image, as decoded with true_planar, to an
+   interleaved one in a new buffer. Needed by code that is not aware
+   of planar areas, e.g. the denoising. The caller's memory of a
+   decoder is left as it is, and x3rgb16 then owns the new buffer. */
+/* extern */ int x3f_image_area_interleave(x3f_t *x3f)
+{
+  x3f_directory_entry_t *DE = x3f_get_raw(x3f);
+  x3f_image_data_t *ID;
+  x3f_area16_t *area;
+  uint16_t *dst;
+  uint32_t size, row;
+
+  if (!DE) return 0;
+
+  ID = &DE->header.data_subsection.image_data;
+  if (ID->tru == NULL || ID->tru->x3rgb16.data == NULL) return 1;
+
+  area = &ID->tru->x3rgb16;
+  if (!area->plane_stride) return 1;
+
+  size = area->rows*area->columns*area->channels;
+  dst = (uint16_t *)malloc(size*sizeof(uint16_t));
+  if (!dst) return 0;
+
+  for (row = 0; row < area->rows; row++)
+    x3f_area_row(area, row, dst + area->columns*area->channels*row);
+
+  free(area->buf);
+  area->data = area->buf = dst;
+  area->row_stride = area->columns*area->channels;
+  area->plane_stride = 0;
+
+  return 1;
+}
+
 /* extern */ int x3f_crop_area8(uint32_t *coord, x3f_area8_t *image,
 				x3f_area8_t *crop)
 {
@@ -177,11 +237,10 @@ static int x3f_transform_rect_to_keep_image(x3f_t *x3f,
   return x3f_transform_rect_to_keep_image(x3f, image, rescale, rect);
 }
 
-/* extern */ int x3f_crop_area_column(x3f_t *x3f, col_side_t which_side,
-				      x3f_area16_t *image, int rescale,
-				      x3f_area16_t *crop)
+/* extern */ int x3f_get_column_rect(x3f_t *x3f, col_side_t which_side,
+				     x3f_area16_t *image, int rescale,
+				     uint32_t *rect)
 {
-  uint32_t rect[4];
   uint32_t column[4];
 
   if (!x3f_get_camf_matrix(x3f, "DarkShieldColRange", 2, 2, 0, M_UINT, column))
@@ -199,12 +258,21 @@ static int x3f_transform_rect_to_keep_image(x3f_t *x3f,
   } else
     return 0;
 
-  if (x3f_transform_rect_to_keep_image(x3f, image, rescale, rect)) {
-    assert(x3f_crop_area(rect, image, crop));
-    return 1;
-  }
+  return x3f_transform_rect_to_keep_image(x3f, image, rescale, rect);
+}
 
-  return 0;
+/* extern */ int x3f_crop_area_column(x3f_t *x3f, col_side_t which_side,
+				      x3f_area16_t *image, int rescale,
+				      x3f_area16_t *crop)
+{
+  uint32_t rect[4];
+
+  if (!x3f_get_column_rect(x3f, which_side, image, rescale, rect)) return 0;
+  /* This should not fail as long as x3f_get_column_rect is
+     implemented correctly */
+  assert(x3f_crop_area(rect, image, crop));
+
+  return 1;
 }
 
 /* extern */ int x3f_crop_area_camf(x3f_t *x3f, char *name,
@@ -20,11 +20,17 @@ extern int x3f_image_area(x3f_t *x3f, x3f_area16_t *image);
 extern int x3f_image_area_qtop(x3f_t *x3f, x3f_area16_t *image);
 extern int x3f_crop_area(uint32_t *coord, x3f_area16_t *image,
 			 x3f_area16_t *crop);
+extern uint16_t *x3f_area_row(x3f_area16_t *area, uint32_t row,
+			      uint16_t *buf);
+extern int x3f_image_area_interleave(x3f_t *x3f);
 extern int x3f_crop_area8(uint32_t *coord, x3f_area8_t *image,
 			  x3f_area8_t *crop);
 extern int x3f_get_camf_rect(x3f_t *x3f, char *name,
 			     x3f_area16_t *image, int rescale,
 			     uint32_t *rect);
+extern int x3f_get_column_rect(x3f_t *x3f, col_side_t which_side,
+			       x3f_area16_t *image, int rescale,
+			       uint32_t *rect);
 extern int x3f_crop_area_column(x3f_t *x3f, col_side_t which_side,
 				x3f_area16_t *image, int rescale,
 				x3f_area16_t *crop);
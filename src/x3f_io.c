@@ -9,6 +9,7 @@
 
 #include "x3f_io.h"
 #include "x3f_printf.h"
+#include "x3f_thread.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -17,8 +18,21 @@
 
 #if defined(_WIN32) || defined (_WIN64)
 #include <windows.h>
+#include <io.h>
 #else
 #include <iconv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 /* --------------------------------------------------------------------- */
@@ -27,6 +41,9 @@
 
 /* extern */ int legacy_offset = 0;
 /* extern */ bool_t auto_legacy_offset = 1;
+/* extern */ bool_t use_mmap = 1;
+/* extern */ uint32_t true_checkpoint_interval = 64;
+/* extern */ bool_t true_planar = 0;
 
 /* --------------------------------------------------------------------- */
 /* Huffman Decode Macros                                                 */
@@ -37,60 +54,111 @@
 #define HUF_TREE_GET_LENGTH(_v) (((_v)>>27)&0x1f)
 #define HUF_TREE_GET_CODE(_v) ((_v)&0x07ffffff)
 
+/* Number of bits looked up at once. Longer codes, and TRUE codes
+   whose difference bits do not fit, are completed in a second step. */
+#define HUF_LUT_BITS 12
+#define HUF_LUT_SIZE (1<<HUF_LUT_BITS)
+#define HUF_LUT_MAX_DIFF_BITS 24
+
 /* --------------------------------------------------------------------- */
 /* Reading and writing - assuming little endian in the file              */
 /* --------------------------------------------------------------------- */
 
-static int x3f_get1(FILE *f)
+/* The input is read at I->input.offset, from the section in memory
+   that is being loaded. See read_data_set_offset. */
+
+static int x3f_get1(x3f_info_t *I)
+{
+  x3f_chunk_t *S = &I->input.section;
+  uint32_t offset = I->input.offset++;
+
+  return offset - S->offset < S->size ? S->data[offset - S->offset] : 0;
+}
+
+static int x3f_get2(x3f_info_t *I)
 {
   /* Little endian file */
-  return getc(f);
+  int b0 = x3f_get1(I);
+  int b1 = x3f_get1(I);
+
+  return (b0<<0) + (b1<<8);
 }
 
-static int x3f_get2(FILE *f)
+static int x3f_get4(x3f_info_t *I)
 {
   /* Little endian file */
-  return (getc(f)<<0) + (getc(f)<<8);
+  int b0 = x3f_get1(I);
+  int b1 = x3f_get1(I);
+  int b2 = x3f_get1(I);
+  int b3 = x3f_get1(I);
+
+  return (b0<<0) + (b1<<8) + (b2<<16) + (b3<<24);
 }
 
-static int x3f_get4(FILE *f)
+static void x3f_put4(FILE *f, uint32_t v)
 {
   /* Little endian file */
-  return (getc(f)<<0) + (getc(f)<<8) + (getc(f)<<16) + (getc(f)<<24);
+  putc((v>>0)&0xff, f);
+  putc((v>>8)&0xff, f);
+  putc((v>>16)&0xff, f);
+  putc((v>>24)&0xff, f);
+}
+
+/* The number of (code_size, code) pairs at the input, up to and
+   including the one ending the table, with code_size 0. The input is
+   not consumed. */
+
+static int x3f_count_true_huff_table(x3f_info_t *I)
+{
+  uint32_t offset = I->input.offset;
+  int num = 1;
+
+  while (x3f_get1(I) != 0) {
+    x3f_get1(I);
+    num++;
+  }
+  I->input.offset = offset;
+
+  return num;
 }
 
 #define FREE(P) do { free(P); (P) = NULL; } while (0)
 
-#define PUT_GET_N(_buffer,_size,_file,_func)			\
-  do								\
-    {								\
-      int _left = _size;					\
-      while (_left != 0) {					\
-	int _cur = _func(_buffer,1,_left,_file);		\
-	if (_cur == 0) {					\
-	  x3f_printf(ERR, "Failure to access file\n");		\
-	  exit(1);						\
-	}							\
-	_left -= _cur;						\
-      }								\
-    } while(0)
-
-#define GET1(_v) do {(_v) = x3f_get1(I->input.file);} while (0)
-#define GET2(_v) do {(_v) = x3f_get2(I->input.file);} while (0)
-#define GET4(_v) do {(_v) = x3f_get4(I->input.file);} while (0)
+#define GET1(_v) do {(_v) = x3f_get1(I);} while (0)
+#define GET2(_v) do {(_v) = x3f_get2(I);} while (0)
+#define GET4(_v) do {(_v) = x3f_get4(I);} while (0)
 #define GET4F(_v)				\
   do {						\
     union {int32_t i; float f;} _tmp;		\
-    _tmp.i = x3f_get4(I->input.file);		\
+    _tmp.i = x3f_get4(I);			\
+    (_v) = _tmp.f;				\
+  } while (0)
+
+/* The same, but reading from memory at _p, and stepping _p */
+
+static uint32_t x3f_mem_get4(uint8_t *p)
+{
+  /* Little endian file */
+  return
+    ((uint32_t)p[0]<<0) + ((uint32_t)p[1]<<8) +
+    ((uint32_t)p[2]<<16) + ((uint32_t)p[3]<<24);
+}
+
+#define MGET4(_p,_v) do {(_v) = x3f_mem_get4(_p); (_p) += 4;} while (0)
+#define MGET4F(_p,_v)				\
+  do {						\
+    union {int32_t i; float f;} _tmp;		\
+    _tmp.i = x3f_mem_get4(_p);			\
+    (_p) += 4;					\
     (_v) = _tmp.f;				\
   } while (0)
-#define GETN(_v,_s) PUT_GET_N(_v,_s,I->input.file,fread)
+#define MGETN(_p,_v,_s) do {memcpy(_v, _p, _s); (_p) += (_s);} while (0)
 
 #define GET_TABLE(_T, _GETX, _NUM)					\
   do {									\
     int _i;								\
     (_T).size = (_NUM);							\
-    (_T).element = (void *)realloc((_T).element,			\
+    (_T).element = x3f_arena_alloc(&I->arena,				\
 				   (_NUM)*sizeof((_T).element[0]));	\
     for (_i = 0; _i < (_T).size; _i++)					\
       _GETX((_T).element[_i]);						\
@@ -100,7 +168,7 @@ static int x3f_get4(FILE *f)
   do {									\
     int _i;								\
     (_T).size = (_NUM);							\
-    (_T).element = (void *)realloc((_T).element,			\
+    (_T).element = x3f_arena_alloc(&I->arena,				\
 				   (_NUM)*sizeof((_T).element[0]));	\
     for (_i = 0; _i < (_T).size; _i++) {				\
       GET4((_T).element[_i].name_offset);				\
@@ -111,40 +179,103 @@ static int x3f_get4(FILE *f)
 #define GET_TRUE_HUFF_TABLE(_T)						\
   do {									\
     int _i;								\
-    (_T).element = NULL;						\
-    for (_i = 0; ; _i++) {						\
-      (_T).size = _i + 1;						\
-      (_T).element = (void *)realloc((_T).element,			\
-				     (_i + 1)*sizeof((_T).element[0]));	\
+    (_T).size = x3f_count_true_huff_table(I);				\
+    (_T).element = x3f_arena_alloc(&I->arena,				\
+				   (_T).size*sizeof((_T).element[0]));	\
+    for (_i = 0; _i < (_T).size; _i++) {				\
       GET1((_T).element[_i].code_size);					\
       GET1((_T).element[_i].code);					\
-      if ((_T).element[_i].code_size == 0) break;			\
     }									\
   } while (0)
 
 /* --------------------------------------------------------------------- */
-/* Allocating Huffman tree help data                                   */
+/* Image and section buffers, kept by the decoder                        */
 /* --------------------------------------------------------------------- */
 
-static void cleanup_huffman_tree(x3f_hufftree_t *HTP)
+/* The smallest kept buffer that is big enough, or a new one */
+static void *get_buffer(x3f_info_t *I, size_t size)
+{
+  x3f_decoder_t *D = I->decoder;
+  int i, best = -1;
+
+  if (D != NULL)
+    for (i=0; i<X3F_DECODER_BUFFERS; i++)
+      if (D->buffer[i].data != NULL && D->buffer[i].size >= size &&
+	  (best < 0 || D->buffer[i].size < D->buffer[best].size))
+	best = i;
+
+  if (best >= 0) {
+    void *data = D->buffer[best].data;
+
+    D->buffer[best].data = NULL;
+    return data;
+  }
+
+  return malloc(size);
+}
+
+/* Give the buffer to the decoder, instead of the smallest buffer it
+   has if it has no free place, or free it */
+static void put_buffer(x3f_info_t *I, void *data, size_t size)
 {
-  free(HTP->nodes);
+  x3f_decoder_t *D = I->decoder;
+  int i, slot = -1;
+
+  if (data == NULL) return;
+
+  if (D != NULL)
+    for (i=0; i<X3F_DECODER_BUFFERS; i++) {
+      if (D->buffer[i].data == NULL) {
+	slot = i;
+	break;
+      }
+      if (D->buffer[i].size < size &&
+	  (slot < 0 || D->buffer[i].size < D->buffer[slot].size))
+	slot = i;
+    }
+
+  if (slot < 0) {
+    free(data);
+    return;
+  }
+
+  free(D->buffer[slot].data);
+  D->buffer[slot].data = data;
+  D->buffer[slot].size = size;
 }
 
-static void new_huffman_tree(x3f_hufftree_t *HTP, int bits)
+#define AREA_SIZE(A, T) ((size_t)(A).rows*(A).columns*(A).channels*sizeof(T))
+
+#define PUT_AREA(I, A, T)				\
+  do {							\
+    put_buffer(I, (A).buf, AREA_SIZE(A, T));		\
+    (A).buf = NULL;					\
+  } while (0)
+
+/* --------------------------------------------------------------------- */
+/* Allocating Huffman tree help data                                   */
+/* --------------------------------------------------------------------- */
+
+/* NOTE: The help data, but not the image buffers, is allocated from
+   the arena of the x3f, and released by x3f_delete. The cleanup
+   functions therefore only free the image buffers. */
+
+static void new_huffman_tree(x3f_arena_t *A, x3f_hufftree_t *HTP, int bits)
 {
   int leaves = 1<<bits;
 
   HTP->free_node_index = 0;
   HTP->nodes = (x3f_huffnode_t *)
-    calloc(1, HUF_TREE_MAX_NODES(leaves)*sizeof(x3f_huffnode_t));
+    x3f_arena_alloc(A, HUF_TREE_MAX_NODES(leaves)*sizeof(x3f_huffnode_t));
+  HTP->lut = (x3f_hufflut_t *)
+    x3f_arena_alloc(A, HUF_LUT_SIZE*sizeof(x3f_hufflut_t));
 }
 
 /* --------------------------------------------------------------------- */
 /* Allocating TRUE engine RAW help data                                  */
 /* --------------------------------------------------------------------- */
 
-static void cleanup_true(x3f_true_t **TRUP)
+static void cleanup_true(x3f_info_t *I, x3f_true_t **TRUP)
 {
   x3f_true_t *TRU = *TRUP;
 
@@ -152,27 +283,24 @@ static void cleanup_true(x3f_true_t **TRUP)
 
   x3f_printf(DEBUG, "Cleanup TRUE data\n");
 
-  FREE(TRU->table.element);
-  FREE(TRU->plane_size.element);
-  cleanup_huffman_tree(&TRU->tree);
-  FREE(TRU->x3rgb16.buf);
-
-  FREE(TRU);
+  PUT_AREA(I, TRU->x3rgb16, uint16_t);
 
   *TRUP = NULL;
 }
 
-static x3f_true_t *new_true(x3f_true_t **TRUP)
+static x3f_true_t *new_true(x3f_info_t *I, x3f_true_t **TRUP)
 {
-  x3f_true_t *TRU = (x3f_true_t *)calloc(1, sizeof(x3f_true_t));
+  x3f_true_t *TRU =
+    (x3f_true_t *)x3f_arena_alloc(&I->arena, sizeof(x3f_true_t));
 
-  cleanup_true(TRUP);
+  cleanup_true(I, TRUP);
 
   TRU->table.size = 0;
   TRU->table.element = NULL;
   TRU->plane_size.size = 0;
   TRU->plane_size.element = NULL;
   TRU->tree.nodes = NULL;
+  TRU->tree.lut = NULL;
   TRU->x3rgb16.data = NULL;
   TRU->x3rgb16.buf = NULL;
 
@@ -181,7 +309,7 @@ static x3f_true_t *new_true(x3f_true_t **TRUP)
   return TRU;
 }
 
-static void cleanup_quattro(x3f_quattro_t **QP)
+static void cleanup_quattro(x3f_info_t *I, x3f_quattro_t **QP)
 {
   x3f_quattro_t *Q = *QP;
 
@@ -189,18 +317,18 @@ static void cleanup_quattro(x3f_quattro_t **QP)
 
   x3f_printf(DEBUG, "Cleanup Quattro\n");
 
-  FREE(Q->top16.buf);
-  FREE(Q);
+  PUT_AREA(I, Q->top16, uint16_t);
 
   *QP = NULL;
 }
 
-static x3f_quattro_t *new_quattro(x3f_quattro_t **QP)
+static x3f_quattro_t *new_quattro(x3f_info_t *I, x3f_quattro_t **QP)
 {
-  x3f_quattro_t *Q = (x3f_quattro_t *)calloc(1, sizeof(x3f_quattro_t));
+  x3f_quattro_t *Q =
+    (x3f_quattro_t *)x3f_arena_alloc(&I->arena, sizeof(x3f_quattro_t));
   int i;
 
-  cleanup_quattro(QP);
+  cleanup_quattro(I, QP);
 
   for (i=0; i<TRUE_PLANES; i++) {
     Q->plane[i].columns = 0;
@@ -217,11 +345,48 @@ static x3f_quattro_t *new_quattro(x3f_quattro_t **QP)
   return Q;
 }
 
+static void cleanup_true_index(x3f_true_index_t **TIP)
+{
+  x3f_true_index_t *TI = *TIP;
+  int i;
+
+  if (TI == NULL) return;
+
+  x3f_printf(DEBUG, "Cleanup TRUE index\n");
+
+  for (i=0; i<TRUE_PLANES; i++)
+    FREE(TI->checkpoint[i].element);
+  FREE(TI);
+
+  *TIP = NULL;
+}
+
+static x3f_true_index_t *new_true_index(x3f_true_index_t **TIP,
+					uint32_t interval)
+{
+  x3f_true_index_t *TI =
+    (x3f_true_index_t *)calloc(1, sizeof(x3f_true_index_t));
+  int i;
+
+  cleanup_true_index(TIP);
+
+  TI->interval = interval;
+  for (i=0; i<TRUE_PLANES; i++) {
+    TI->plane_size[i] = 0;
+    TI->checkpoint[i].size = 0;
+    TI->checkpoint[i].element = NULL;
+  }
+
+  *TIP = TI;
+
+  return TI;
+}
+
 /* --------------------------------------------------------------------- */
 /* Allocating Huffman engine help data                                   */
 /* --------------------------------------------------------------------- */
 
-static void cleanup_huffman(x3f_huffman_t **HUFP)
+static void cleanup_huffman(x3f_info_t *I, x3f_huffman_t **HUFP)
 {
   x3f_huffman_t *HUF = *HUFP;
 
@@ -229,22 +394,18 @@ static void cleanup_huffman(x3f_huffman_t **HUFP)
 
   x3f_printf(DEBUG, "Cleanup Huffman\n");
 
-  FREE(HUF->mapping.element);
-  FREE(HUF->table.element);
-  cleanup_huffman_tree(&HUF->tree);
-  FREE(HUF->row_offsets.element);
-  FREE(HUF->rgb8.buf);
-  FREE(HUF->x3rgb16.buf);
-  FREE(HUF);
+  PUT_AREA(I, HUF->rgb8, uint8_t);
+  PUT_AREA(I, HUF->x3rgb16, uint16_t);
 
   *HUFP = NULL;
 }
 
-static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
+static x3f_huffman_t *new_huffman(x3f_info_t *I, x3f_huffman_t **HUFP)
 {
-  x3f_huffman_t *HUF = (x3f_huffman_t *)calloc(1, sizeof(x3f_huffman_t));
+  x3f_huffman_t *HUF =
+    (x3f_huffman_t *)x3f_arena_alloc(&I->arena, sizeof(x3f_huffman_t));
 
-  cleanup_huffman(HUFP);
+  cleanup_huffman(I, HUFP);
 
   /* Set all not read data block pointers to NULL */
   HUF->mapping.size = 0;
@@ -252,6 +413,7 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
   HUF->table.size = 0;
   HUF->table.element = NULL;
   HUF->tree.nodes = NULL;
+  HUF->tree.lut = NULL;
   HUF->row_offsets.size = 0;
   HUF->row_offsets.element = NULL;
   HUF->rgb8.data = NULL;
@@ -265,322 +427,985 @@ static x3f_huffman_t *new_huffman(x3f_huffman_t **HUFP)
 }
 
 /* --------------------------------------------------------------------- */
-/* Creating a new x3f structure from file                                */
+/* Name indexes                                                          */
 /* --------------------------------------------------------------------- */
 
-/* extern */ x3f_t *x3f_new_from_file(FILE *infile)
+/* FNV-1a */
+static uint32_t hash_name(const char *name)
 {
-  x3f_t *x3f = (x3f_t *)calloc(1, sizeof(x3f_t));
-  x3f_info_t *I = NULL;
-  x3f_header_t *H = NULL;
-  x3f_directory_section_t *DS = NULL;
-  int i, d;
+  uint32_t hash = 2166136261u;
 
-  I = &x3f->info;
-  I->error = NULL;
-  I->input.file = infile;
-  I->output.file = NULL;
+  while (*name)
+    hash = (hash ^ (uint8_t)*name++) * 16777619u;
 
-  if (infile == NULL) {
-    I->error = "No infile";
-    return x3f;
-  }
+  return hash;
+}
 
-  /* Read file header */
-  H = &x3f->header;
-  fseek(infile, 0, SEEK_SET);
-  GET4(H->identifier);
+/* Index num names, where get_name(table, i) is the name at position
+   i. Names for which get_name returns NULL are not indexed. */
+static void build_name_index(x3f_arena_t *A,
+			     x3f_name_index_t *NI, uint32_t num,
+			     char *(*get_name)(void *table, uint32_t i),
+			     void *table)
+{
+  uint32_t size = 1, i;
 
-  if (H->identifier != X3F_FOVb) {
-    x3f_printf(ERR, "Faulty file type\n");
-    x3f_delete(x3f);
-    return NULL;
-  }
+  while (size < 2*num) size <<= 1;
 
-  GET4(H->version);
-  GETN(H->unique_identifier, SIZE_UNIQUE_IDENTIFIER);
-  /* TODO: the meaning of the rest of the header for version >= 4.0
-           (Quattro) is unknown */
-  if (H->version < X3F_VERSION_4_0) {
-    GET4(H->mark_bits);
-    GET4(H->columns);
-    GET4(H->rows);
-    GET4(H->rotation);
-    if (H->version >= X3F_VERSION_2_1) {
-      int num_ext_data =
-	H->version >= X3F_VERSION_3_0 ? NUM_EXT_DATA_3_0 : NUM_EXT_DATA_2_1;
+  NI->size = size;
+  NI->element = (x3f_name_index_entry_t *)
+    x3f_arena_alloc(A, size*sizeof(x3f_name_index_entry_t));
 
-      GETN(H->white_balance, SIZE_WHITE_BALANCE);
-      if (H->version >= X3F_VERSION_2_3)
-	GETN(H->color_mode, SIZE_COLOR_MODE);
-      GETN(H->extended_types, num_ext_data);
-      for (i=0; i<num_ext_data; i++)
-	GET4F(H->extended_data[i]);
-    }
-  }
+  for (i=0; i<num; i++) {
+    char *name = get_name(table, i);
+    uint32_t slot;
 
-  /* Go to the beginning of the directory */
-  fseek(infile, -4, SEEK_END);
-  fseek(infile, x3f_get4(infile), SEEK_SET);
+    if (name == NULL) continue;
 
-  /* Read the directory header */
-  DS = &x3f->directory_section;
-  GET4(DS->identifier);
-  GET4(DS->version);
-  GET4(DS->num_directory_entries);
+    for (slot = hash_name(name) & (size - 1);
+	 NI->element[slot].name != NULL;
+	 slot = (slot + 1) & (size - 1))
+      if (!strcmp(NI->element[slot].name, name)) break;
 
-  if (DS->num_directory_entries > 0) {
-    size_t size = DS->num_directory_entries * sizeof(x3f_directory_entry_t);
-    DS->directory_entry = (x3f_directory_entry_t *)calloc(1, size);
+    /* Keep the first one */
+    if (NI->element[slot].name != NULL) continue;
+
+    NI->element[slot].name = name;
+    NI->element[slot].position = i;
   }
+}
 
-  /* Traverse the directory */
-  for (d=0; d<DS->num_directory_entries; d++) {
-    x3f_directory_entry_t *DE = &DS->directory_entry[d];
-    x3f_directory_entry_header_t *DEH = &DE->header;
-    uint32_t save_dir_pos;
+/* extern */ int x3f_find_name(x3f_name_index_t *NI, const char *name)
+{
+  uint32_t slot;
 
-    /* Read the directory entry info */
-    GET4(DE->input.offset);
-    GET4(DE->input.size);
+  if (NI->size == 0) return -1;
 
-    DE->output.offset = 0;
-    DE->output.size = 0;
+  for (slot = hash_name(name) & (NI->size - 1);
+       NI->element[slot].name != NULL;
+       slot = (slot + 1) & (NI->size - 1))
+    if (!strcmp(NI->element[slot].name, name))
+      return NI->element[slot].position;
 
-    GET4(DE->type);
+  return -1;
+}
 
-    /* Save current pos and go to the entry */
-    save_dir_pos = ftell(infile);
-    fseek(infile, DE->input.offset, SEEK_SET);
+/* --------------------------------------------------------------------- */
+/* Mapping the input file into memory                                    */
+/* --------------------------------------------------------------------- */
 
-    /* Read the type independent part of the entry header */
-    DEH = &DE->header;
-    GET4(DEH->identifier);
-    GET4(DEH->version);
+/* If the input file is mapped, the data blocks point straight into
+   the mapping instead of being read into allocated buffers. If the
+   mapping fails, the file is read as usual. */
 
-    /* NOTE - the tests below could be made on DE->type instead */
+static void map_input(x3f_info_t *I)
+{
+#if defined(_WIN32) || defined (_WIN64)
+  HANDLE file = (HANDLE)_get_osfhandle(_fileno(I->input.file));
+  LARGE_INTEGER size;
+  HANDLE mapping;
 
-    if (DEH->identifier == X3F_SECp) {
-      x3f_property_list_t *PL = &DEH->data_subsection.property_list;
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) ||
+      size.QuadPart == 0 || size.QuadPart > UINT32_MAX)
+    return;
 
-      /* Read the property part of the header */
-      GET4(PL->num_properties);
-      GET4(PL->character_format);
-      GET4(PL->reserved);
-      GET4(PL->total_length);
+  mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL)
+    return;
 
-      /* Set all not read data block pointers to NULL */
-      PL->data = NULL;
-      PL->data_size = 0;
-    }
+  I->map.data = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);		/* The view keeps the mapping alive */
 
-    if (DEH->identifier == X3F_SECi) {
-      x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  if (I->map.data == NULL)
+    return;
 
-      /* Read the image part of the header */
-      GET4(ID->type);
-      GET4(ID->format);
-      ID->type_format = (ID->type << 16) + (ID->format);
-      GET4(ID->columns);
-      GET4(ID->rows);
-      GET4(ID->row_stride);
+  I->map.size = size.QuadPart;
+#else
+  struct stat filestat;
+  void *data;
 
-      /* Set all not read data block pointers to NULL */
-      ID->huffman = NULL;
+  if (fstat(fileno(I->input.file), &filestat) != 0 ||
+      filestat.st_size == 0 || filestat.st_size > UINT32_MAX)
+    return;
 
-      ID->data = NULL;
-      ID->data_size = 0;
-    }
+  data = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE,
+	      fileno(I->input.file), 0);
+  if (data == MAP_FAILED)
+    return;
 
-    if (DEH->identifier == X3F_SECc) {
-      x3f_camf_t *CAMF = &DEH->data_subsection.camf;
+  I->map.data = (uint8_t *)data;
+  I->map.size = filestat.st_size;
+#endif
 
-      /* Read the CAMF part of the header */
-      GET4(CAMF->type);
-      GET4(CAMF->tN.val0);
-      GET4(CAMF->tN.val1);
-      GET4(CAMF->tN.val2);
-      GET4(CAMF->tN.val3);
+  x3f_printf(DEBUG, "Mapped input file, %u bytes\n", I->map.size);
+}
 
-      /* Set all not read data block pointers to NULL */
-      CAMF->data = NULL;
-      CAMF->data_size = 0;
-
-      /* Set all not allocated help pointers to NULL */
-      CAMF->table.element = NULL;
-      CAMF->table.size = 0;
-      CAMF->tree.nodes = NULL;
-      CAMF->decoded_data = NULL;
-      CAMF->decoded_data_size = 0;
-      CAMF->entry_table.element = NULL;
-      CAMF->entry_table.size = 0;
-    }
+static void unmap_input(x3f_info_t *I)
+{
+  if (I->map.data == NULL) return;
 
-    /* Reset the file pointer back to the directory */
-    fseek(infile, save_dir_pos, SEEK_SET);
+  /* Memory given by the caller is left as it is */
+  if (I->input.file == NULL) {
+    I->map.data = NULL;
+    I->map.size = 0;
+    return;
   }
 
-  return x3f;
+#if defined(_WIN32) || defined (_WIN64)
+  UnmapViewOfFile(I->map.data);
+#else
+  munmap(I->map.data, I->map.size);
+#endif
+
+  I->map.data = NULL;
+  I->map.size = 0;
 }
 
 /* --------------------------------------------------------------------- */
-/* Clean up an x3f structure                                             */
+/* Reading the input                                                     */
 /* --------------------------------------------------------------------- */
 
-static void free_camf_entry(camf_entry_t *entry)
+/* Unless the input is in memory, it is read through I->input.io, in
+   chunks that are kept until x3f_delete. The data blocks point into
+   the memory or the chunks, and are never freed by themselves. */
+
+static uint32_t file_read_at(void *handle, uint32_t offset, uint32_t size,
+			     void *buf)
 {
-  FREE(entry->property_name);
-  FREE(entry->property_value);
-  FREE(entry->matrix_decoded);
-  FREE(entry->matrix_dim_entry);
+  FILE *f = (FILE *)handle;
+
+  if (fseek(f, offset, SEEK_SET) != 0)
+    return 0;
+
+  return fread(buf, 1, size, f);
 }
 
-/* extern */ x3f_return_t x3f_delete(x3f_t *x3f)
+static uint32_t file_size(void *handle)
 {
-  x3f_directory_section_t *DS;
-  int d;
+  FILE *f = (FILE *)handle;
+  long size;
 
-  if (x3f == NULL)
-    return X3F_ARGUMENT_ERROR;
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
 
-  x3f_printf(DEBUG, "X3F Delete\n");
+  return size < 0 || size > UINT32_MAX ? 0 : size;
+}
 
-  DS = &x3f->directory_section;
+static uint32_t get_file_size(x3f_info_t *I)
+{
+  if (I->map.data != NULL)
+    return I->map.size;
 
-  for (d=0; d<DS->num_directory_entries; d++) {
-    x3f_directory_entry_t *DE = &DS->directory_entry[d];
-    x3f_directory_entry_header_t *DEH = &DE->header;
+  return I->input.io.size(I->input.io.handle);
+}
 
-    if (DEH->identifier == X3F_SECp) {
-      x3f_property_list_t *PL = &DEH->data_subsection.property_list;
-      int i;
+/* Get size bytes at offset. If in memory, and all of it is in the
+   file, a pointer into the memory is returned. Otherwise the bytes
+   are read into buf. Bytes beyond the end of the file are set to 0. */
 
-      for (i=0; i<PL->property_table.size; i++) {
-	FREE(PL->property_table.element[i].name_utf8);
-	FREE(PL->property_table.element[i].value_utf8);
-      }
+static uint8_t *read_range(x3f_info_t *I, uint32_t file_size,
+			   uint32_t offset, uint32_t size, uint8_t *buf)
+{
+  uint32_t avail = offset >= file_size ? 0 :
+    file_size - offset < size ? file_size - offset : size;
 
-      FREE(PL->property_table.element);
-      FREE(PL->data);
-    }
+  if (I->map.data != NULL) {
+    if (avail == size)
+      return I->map.data + offset;
+    memcpy(buf, I->map.data + offset, avail);
+  } else if (avail > 0)
+    avail = I->input.io.read_at(I->input.io.handle, offset, avail, buf);
 
-    if (DEH->identifier == X3F_SECi) {
-      x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  memset(buf + avail, 0, size - avail);
 
-      cleanup_huffman(&ID->huffman);
+  return buf;
+}
 
-      cleanup_true(&ID->tru);
+/* Returns NULL if not all of it is in memory */
 
-      cleanup_quattro(&ID->quattro);
+static uint8_t *find_chunk(x3f_info_t *I, uint32_t offset, uint32_t size)
+{
+  int i;
 
-      FREE(ID->data);
-    }
+  if (I->map.data != NULL &&
+      offset <= I->map.size && I->map.size - offset >= size)
+    return I->map.data + offset;
 
-    if (DEH->identifier == X3F_SECc) {
-      x3f_camf_t *CAMF = &DEH->data_subsection.camf;
-      int i;
+  for (i=0; i<I->chunks.size; i++) {
+    x3f_chunk_t *C = &I->chunks.element[i];
 
-      FREE(CAMF->data);
-      FREE(CAMF->table.element);
-      cleanup_huffman_tree(&CAMF->tree);
-      FREE(CAMF->decoded_data);
-      for (i=0; i < CAMF->entry_table.size; i++) {
-	free_camf_entry(&CAMF->entry_table.element[i]);
-      }
-      FREE(CAMF->entry_table.element);
-    }
+    if (offset >= C->offset && offset - C->offset <= C->size &&
+	C->size - (offset - C->offset) >= size)
+      return C->data + (offset - C->offset);
   }
 
-  FREE(DS->directory_entry);
-  FREE(x3f);
-
-  return X3F_OK;
+  return NULL;
 }
 
 /* --------------------------------------------------------------------- */
-/* Getting a reference to a directory entry                              */
+/* Copying the input to a file                                           */
 /* --------------------------------------------------------------------- */
 
-/* TODO: all those only get the first instance */
+#define X3F_COPY_BUFFER_SIZE (1024*1024)
 
-static x3f_directory_entry_t *x3f_get(x3f_t *x3f,
-                                      uint32_t type,
-                                      uint32_t image_type)
+#if defined(__linux__)
+/* Let the kernel copy from the input file to the output, without going
+   through user space. Returns the number of bytes copied, which is
+   less than size if the kernel could not do it all. */
+
+static uint32_t kernel_copy(int in, uint32_t offset, uint32_t size, int out)
 {
-  x3f_directory_section_t *DS;
-  int d;
+  uint32_t done = 0;
+#ifdef SYS_copy_file_range
+  bool_t copy_range = 1;
+#endif
 
-  if (x3f == NULL) return NULL;
+  while (done < size) {
+    ssize_t n = -1;
 
-  DS = &x3f->directory_section;
+#ifdef SYS_copy_file_range
+    /* Fails between file systems on older kernels, and if the output
+       is not a regular file */
+    if (copy_range) {
+      int64_t in_offset = offset + done;
 
-  for (d=0; d<DS->num_directory_entries; d++) {
-    x3f_directory_entry_t *DE = &DS->directory_entry[d];
-    x3f_directory_entry_header_t *DEH = &DE->header;
+      n = syscall(SYS_copy_file_range, in, &in_offset, out, NULL,
+		  (size_t)(size - done), 0);
+      if (n < 0) copy_range = 0;
+    }
+#endif
 
-    if (DEH->identifier == type) {
-      switch (DEH->identifier) {
-      case X3F_SECi:
-        {
-          x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+    if (n < 0) {
+      off_t in_offset = offset + done;
 
-          if (ID->type_format == image_type)
-            return DE;
-        }
-        break;
-      default:
-        return DE;
-      }
+      n = sendfile(out, in, &in_offset, size - done);
     }
+
+    if (n <= 0) break;
+    done += n;
   }
 
-  return NULL;
+  return done;
 }
+#endif
 
-/* extern */ x3f_directory_entry_t *x3f_get_raw(x3f_t *x3f)
+/* extern */ x3f_return_t x3f_copy_input(x3f_t *x3f, uint32_t offset,
+					 uint32_t size, FILE *outfile)
 {
-  x3f_directory_entry_t *DE;
+  x3f_info_t *I = &x3f->info;
+  uint32_t file_size = get_file_size(I);
+  uint32_t avail = offset >= file_size ? 0 :
+    file_size - offset < size ? file_size - offset : size;
+  uint32_t done = 0;
+  uint8_t *buf = NULL, *p;
+
+  if (avail > 0 && I->map.data == NULL &&
+      (p = find_chunk(I, offset, avail)) != NULL) {
+    /* Already read */
+    if (fwrite(p, 1, avail, outfile) != avail)
+      return X3F_OUTFILE_ERROR;
+    done = avail;
+  }
+#if defined(__linux__)
+  else if (avail > 0 && I->input.file != NULL) {
+    int out = fileno(outfile);
+    off_t position;
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_X530)) != NULL)
-    return DE;
+    fflush(outfile);
+    done = kernel_copy(fileno(I->input.file), offset, avail, out);
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_10BIT)) != NULL)
-    return DE;
+    /* The kernel moved the file position behind the back of stdio */
+    if ((position = lseek(out, 0, SEEK_CUR)) >= 0)
+      fseek(outfile, position, SEEK_SET);
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_TRUE)) != NULL)
-    return DE;
+    x3f_printf(DEBUG, "Kernel copied %u of %u bytes\n", done, avail);
+  }
+#endif
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_MERRILL)) != NULL)
-    return DE;
+  /* Whatever is left is copied through memory. If the input is
+     mapped, it is written from the mapping. */
+  if (done < avail && I->map.data == NULL) {
+    buf = (uint8_t *)malloc(X3F_COPY_BUFFER_SIZE);
+    if (buf == NULL)
+      return X3F_INTERNAL_ERROR;
+  }
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_QUATTRO)) != NULL)
-    return DE;
+  while (done < avail) {
+    uint32_t n = avail - done < X3F_COPY_BUFFER_SIZE ?
+      avail - done : X3F_COPY_BUFFER_SIZE;
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQ)) != NULL)
-    return DE;
+    p = read_range(I, file_size, offset + done, n, buf);
+    if (fwrite(p, 1, n, outfile) != n) {
+      free(buf);
+      return X3F_OUTFILE_ERROR;
+    }
+    done += n;
+  }
 
-  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQH)) != NULL)
-    return DE;
+  free(buf);
 
-  return NULL;
-}
+  /* Beyond the end of the input */
+  if (size > avail) {
+    static const uint8_t zeros[1024];
+    uint32_t left = size - avail;
 
-/* extern */ x3f_directory_entry_t *x3f_get_thumb_plain(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_PLAIN);
-}
+    while (left > 0) {
+      uint32_t n = left < sizeof(zeros) ? left : sizeof(zeros);
 
-/* extern */ x3f_directory_entry_t *x3f_get_thumb_huffman(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_HUFFMAN);
-}
+      if (fwrite(zeros, 1, n, outfile) != n)
+	return X3F_OUTFILE_ERROR;
+      left -= n;
+    }
+  }
 
-/* extern */ x3f_directory_entry_t *x3f_get_thumb_jpeg(x3f_t *x3f)
-{
-  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_JPEG);
+  return X3F_OK;
 }
 
-/* extern */ x3f_directory_entry_t *x3f_get_camf(x3f_t *x3f)
+/* Returns NULL if there is no memory for it */
+
+static uint8_t *read_chunk(x3f_info_t *I, uint32_t offset, uint32_t size)
+{
+  x3f_chunk_t *C, *element;
+  uint8_t *data;
+
+  if (offset > I->input.size || I->input.size - offset < size)
+    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Data beyond the end of the file\n");
+
+  data = (uint8_t *)get_buffer(I, size);
+  if (data == NULL && size > 0) {
+    x3f_printf(ERR, "Could not allocate %u bytes for data at %u\n",
+	       size, offset);
+    return NULL;
+  }
+
+  element = (x3f_chunk_t *)
+    realloc(I->chunks.element, (I->chunks.size + 1)*sizeof(x3f_chunk_t));
+  if (element == NULL) {
+    put_buffer(I, data, size);
+    return NULL;
+  }
+  I->chunks.element = element;
+  C = &I->chunks.element[I->chunks.size++];
+
+  C->offset = offset;
+  C->size = size;
+  C->data = data;
+
+  x3f_printf(DEBUG, "Read %u bytes at %u\n", size, offset);
+
+  return read_range(I, I->input.size, offset, size, C->data);
+}
+
+static void free_chunks(x3f_info_t *I)
+{
+  int i;
+
+  for (i=0; i<I->chunks.size; i++)
+    put_buffer(I, I->chunks.element[i].data, I->chunks.element[i].size);
+  FREE(I->chunks.element);
+  I->chunks.size = 0;
+}
+
+/* --------------------------------------------------------------------- */
+/* Creating a new x3f structure from file                                */
+/* --------------------------------------------------------------------- */
+
+/* The header, the directory and the section headers are fetched with
+   a few bulk reads and parsed from memory. If the file is mapped
+   nothing is read at all. */
+
+#define X3F_HEADER_MAX_SIZE						\
+  (4 + 4 + SIZE_UNIQUE_IDENTIFIER + 4*4 +				\
+   SIZE_WHITE_BALANCE + SIZE_COLOR_MODE + NUM_EXT_DATA*(1 + 4))
+
+#define X3F_DIRECTORY_HEADER_SIZE 12
+#define X3F_DIRECTORY_ENTRY_SIZE 12
+#define X3F_SECTION_HEADER_MAX_SIZE X3F_IMAGE_HEADER_SIZE
+
+/* The directory is mostly small enough to be in this tail */
+#define X3F_DIRECTORY_TAIL_SIZE 1024
+
+/* Section headers closer than this are read together */
+#define X3F_COALESCE_GAP 4096
+#define X3F_COALESCE_MAX (256*1024)
+
+static void parse_header(x3f_header_t *H, uint8_t *p)
+{
+  int i;
+
+  MGET4(p, H->identifier);
+  MGET4(p, H->version);
+  MGETN(p, H->unique_identifier, SIZE_UNIQUE_IDENTIFIER);
+  /* TODO: the meaning of the rest of the header for version >= 4.0
+           (Quattro) is unknown */
+  if (H->version < X3F_VERSION_4_0) {
+    MGET4(p, H->mark_bits);
+    MGET4(p, H->columns);
+    MGET4(p, H->rows);
+    MGET4(p, H->rotation);
+    if (H->version >= X3F_VERSION_2_1) {
+      int num_ext_data =
+	H->version >= X3F_VERSION_3_0 ? NUM_EXT_DATA_3_0 : NUM_EXT_DATA_2_1;
+
+      MGETN(p, H->white_balance, SIZE_WHITE_BALANCE);
+      if (H->version >= X3F_VERSION_2_3)
+	MGETN(p, H->color_mode, SIZE_COLOR_MODE);
+      MGETN(p, H->extended_types, num_ext_data);
+      for (i=0; i<num_ext_data; i++)
+	MGET4F(p, H->extended_data[i]);
+    }
+  }
+}
+
+static void parse_section_header(x3f_directory_entry_t *DE, uint8_t *p)
+{
+  x3f_directory_entry_header_t *DEH = &DE->header;
+
+  /* Read the type independent part of the entry header */
+  MGET4(p, DEH->identifier);
+  MGET4(p, DEH->version);
+
+  /* NOTE - the tests below could be made on DE->type instead */
+
+  if (DEH->identifier == X3F_SECp) {
+    x3f_property_list_t *PL = &DEH->data_subsection.property_list;
+
+    /* Read the property part of the header */
+    MGET4(p, PL->num_properties);
+    MGET4(p, PL->character_format);
+    MGET4(p, PL->reserved);
+    MGET4(p, PL->total_length);
+
+    /* Set all not read data block pointers to NULL */
+    PL->data = NULL;
+    PL->data_size = 0;
+    PL->property_index.element = NULL;
+    PL->property_index.size = 0;
+  }
+
+  if (DEH->identifier == X3F_SECi) {
+    x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+
+    /* Read the image part of the header */
+    MGET4(p, ID->type);
+    MGET4(p, ID->format);
+    ID->type_format = (ID->type << 16) + (ID->format);
+    MGET4(p, ID->columns);
+    MGET4(p, ID->rows);
+    MGET4(p, ID->row_stride);
+
+    /* Set all not read data block pointers to NULL */
+    ID->huffman = NULL;
+    ID->true_index = NULL;
+    ID->stats = NULL;
+    ID->planes = X3F_PLANES_ALL;
+
+    ID->data = NULL;
+    ID->data_size = 0;
+  }
+
+  if (DEH->identifier == X3F_SECc) {
+    x3f_camf_t *CAMF = &DEH->data_subsection.camf;
+
+    /* Read the CAMF part of the header */
+    MGET4(p, CAMF->type);
+    MGET4(p, CAMF->tN.val0);
+    MGET4(p, CAMF->tN.val1);
+    MGET4(p, CAMF->tN.val2);
+    MGET4(p, CAMF->tN.val3);
+
+    /* Set all not read data block pointers to NULL */
+    CAMF->data = NULL;
+    CAMF->data_size = 0;
+
+    /* Set all not allocated help pointers to NULL */
+    CAMF->table.element = NULL;
+    CAMF->table.size = 0;
+    CAMF->tree.nodes = NULL;
+    CAMF->tree.lut = NULL;
+    CAMF->decoded_data = NULL;
+    CAMF->decoded_data_size = 0;
+    CAMF->entry_table.element = NULL;
+    CAMF->entry_table.size = 0;
+    CAMF->entry_index.element = NULL;
+    CAMF->entry_index.size = 0;
+  }
+}
+
+static int compare_entry_offset(const void *a, const void *b)
+{
+  uint32_t offset_a = (*(x3f_directory_entry_t **)a)->input.offset;
+  uint32_t offset_b = (*(x3f_directory_entry_t **)b)->input.offset;
+
+  return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+/* Read the section headers in offset order. Headers near each other
+   are fetched with one read. Returns 0 if out of memory. */
+
+static int read_section_headers(x3f_info_t *I, uint32_t file_size,
+				 x3f_directory_section_t *DS)
+{
+  uint32_t num = DS->num_directory_entries;
+  x3f_directory_entry_t **sorted;
+  uint8_t *buf = NULL;
+  uint32_t first, last, d;
+
+  if (num == 0) return 1;
+
+  sorted = (x3f_directory_entry_t **)malloc(num*sizeof(*sorted));
+  if (sorted == NULL) return 0;
+
+  for (d=0; d<num; d++)
+    sorted[d] = &DS->directory_entry[d];
+  qsort(sorted, num, sizeof(*sorted), compare_entry_offset);
+
+  /* The offsets are from the file, and the ends are computed in 64
+     bits so that they can not wrap */
+  for (first = 0; first < num; first = last) {
+    uint32_t start = sorted[first]->input.offset;
+    uint64_t end = (uint64_t)start + X3F_SECTION_HEADER_MAX_SIZE;
+    uint8_t *p;
+
+    for (last = first + 1; last < num; last++) {
+      uint64_t next = sorted[last]->input.offset;
+
+      if (next > end + X3F_COALESCE_GAP ||
+	  next + X3F_SECTION_HEADER_MAX_SIZE - start > X3F_COALESCE_MAX)
+	break;
+      end = next + X3F_SECTION_HEADER_MAX_SIZE;
+    }
+
+    p = (uint8_t *)realloc(buf, end - start);
+    if (p == NULL) {
+      free(buf);
+      free(sorted);
+      return 0;
+    }
+    buf = p;
+    p = read_range(I, file_size, start, end - start, buf);
+
+    for (d=first; d<last; d++)
+      parse_section_header(sorted[d], p + sorted[d]->input.offset - start);
+  }
+
+  free(buf);
+  free(sorted);
+
+  return 1;
+}
+
+/* Parse the header and the directory, from the file or memory set up
+   in x3f->info */
+
+static x3f_t *x3f_parse(x3f_t *x3f)
+{
+  x3f_info_t *I = &x3f->info;
+  x3f_header_t *H = NULL;
+  x3f_directory_section_t *DS = NULL;
+  uint8_t header[X3F_HEADER_MAX_SIZE];
+  uint8_t tail[X3F_DIRECTORY_TAIL_SIZE];
+  uint8_t *dir_buf = NULL;
+  uint32_t file_size, tail_offset, dir_offset, max_entries;
+  uint8_t *p;
+  int d;
+
+  file_size = I->input.size = get_file_size(I);
+
+  /* Read file header */
+  H = &x3f->header;
+  parse_header(H, read_range(I, file_size, 0, X3F_HEADER_MAX_SIZE, header));
+
+  if (H->identifier != X3F_FOVb) {
+    x3f_printf(ERR, "Faulty file type\n");
+    x3f_delete(x3f);
+    return NULL;
+  }
+
+  if (file_size < 4) {
+    x3f_printf(ERR, "File too small for a directory offset\n");
+    x3f_delete(x3f);
+    return NULL;
+  }
+
+  /* Read the end of the file, where the last word is the offset to
+     the directory. Most often the whole directory is in there. */
+  tail_offset = file_size > X3F_DIRECTORY_TAIL_SIZE ?
+    file_size - X3F_DIRECTORY_TAIL_SIZE : 0;
+  p = read_range(I, file_size, tail_offset, X3F_DIRECTORY_TAIL_SIZE, tail);
+  dir_offset = x3f_mem_get4(p + file_size - tail_offset - 4);
+
+  if (dir_offset > file_size - 4 ||
+      file_size - 4 - dir_offset < X3F_DIRECTORY_HEADER_SIZE) {
+    x3f_printf(ERR, "Faulty directory offset\n");
+    x3f_delete(x3f);
+    return NULL;
+  }
+
+  if (dir_offset >= tail_offset)
+    p += dir_offset - tail_offset;
+  else {
+    uint32_t size = file_size - dir_offset;
+
+    dir_buf = (uint8_t *)malloc(size);
+    p = read_range(I, file_size, dir_offset, size, dir_buf);
+  }
+
+  /* Read the directory header */
+  DS = &x3f->directory_section;
+  MGET4(p, DS->identifier);
+  MGET4(p, DS->version);
+  MGET4(p, DS->num_directory_entries);
+
+  max_entries = (file_size - 4 - dir_offset - X3F_DIRECTORY_HEADER_SIZE) /
+    X3F_DIRECTORY_ENTRY_SIZE;
+  if (DS->num_directory_entries > max_entries) {
+    x3f_printf(ERR, "Too many directory entries: %u\n",
+	       DS->num_directory_entries);
+    DS->num_directory_entries = max_entries;
+  }
+
+  if (DS->num_directory_entries > 0) {
+    size_t size = DS->num_directory_entries * sizeof(x3f_directory_entry_t);
+    DS->directory_entry =
+      (x3f_directory_entry_t *)x3f_arena_alloc(&I->arena, size);
+  }
+
+  /* Traverse the directory */
+  for (d=0; d<DS->num_directory_entries; d++) {
+    x3f_directory_entry_t *DE = &DS->directory_entry[d];
+
+    /* Read the directory entry info */
+    MGET4(p, DE->input.offset);
+    MGET4(p, DE->input.size);
+
+    DE->output.offset = 0;
+    DE->output.size = 0;
+
+    MGET4(p, DE->type);
+  }
+
+  free(dir_buf);
+
+  if (!read_section_headers(I, file_size, DS)) {
+    x3f_printf(ERR, "Could not allocate memory for the section headers\n");
+    x3f_delete(x3f);
+    return NULL;
+  }
+
+  return x3f;
+}
+
+static x3f_t *new_from_file(FILE *infile, bool_t map)
+{
+  x3f_t *x3f = (x3f_t *)calloc(1, sizeof(x3f_t));
+  x3f_info_t *I = &x3f->info;
+
+  I->error = NULL;
+  I->input.file = infile;
+  I->input.io.handle = infile;
+  I->input.io.read_at = file_read_at;
+  I->input.io.size = file_size;
+  I->input.offset = 0;
+  I->output.file = NULL;
+  I->map.data = NULL;
+  I->map.size = 0;
+
+  if (infile == NULL) {
+    I->error = "No infile";
+    return x3f;
+  }
+
+  if (map)
+    map_input(I);
+
+  return x3f_parse(x3f);
+}
+
+/* extern */ x3f_t *x3f_new_from_file(FILE *infile)
+{
+  return new_from_file(infile, use_mmap);
+}
+
+/* extern */ x3f_t *x3f_new_from_memory(const uint8_t *data, size_t size)
+{
+  x3f_t *x3f = (x3f_t *)calloc(1, sizeof(x3f_t));
+  x3f_info_t *I = &x3f->info;
+
+  I->error = NULL;
+  I->input.file = NULL;
+  I->input.offset = 0;
+  I->output.file = NULL;
+  I->map.data = NULL;
+  I->map.size = 0;
+
+  if (data == NULL || size == 0 || size > UINT32_MAX) {
+    I->error = "No indata";
+    return x3f;
+  }
+
+  /* Never written to, as with a read only mapping of a file */
+  I->map.data = (uint8_t *)data;
+  I->map.size = size;
+
+  return x3f_parse(x3f);
+}
+
+/* extern */ x3f_t *x3f_new_from_io(x3f_io_t *io)
+{
+  x3f_t *x3f = (x3f_t *)calloc(1, sizeof(x3f_t));
+  x3f_info_t *I = &x3f->info;
+
+  I->error = NULL;
+  I->input.file = NULL;
+  I->input.offset = 0;
+  I->output.file = NULL;
+  I->map.data = NULL;
+  I->map.size = 0;
+
+  if (io == NULL || io->read_at == NULL || io->size == NULL) {
+    I->error = "No input";
+    return x3f;
+  }
+
+  I->input.io = *io;
+
+  return x3f_parse(x3f);
+}
+
+/* --------------------------------------------------------------------- */
+/* Clean up an x3f structure                                             */
+/* --------------------------------------------------------------------- */
+
+/* extern */ x3f_return_t x3f_delete(x3f_t *x3f)
+{
+  x3f_directory_section_t *DS;
+  int d;
+
+  if (x3f == NULL)
+    return X3F_ARGUMENT_ERROR;
+
+  x3f_printf(DEBUG, "X3F Delete\n");
+
+  DS = &x3f->directory_section;
+
+  for (d=0; d<DS->num_directory_entries; d++) {
+    x3f_directory_entry_t *DE = &DS->directory_entry[d];
+    x3f_directory_entry_header_t *DEH = &DE->header;
+
+    if (DEH->identifier == X3F_SECp) {
+      x3f_property_list_t *PL = &DEH->data_subsection.property_list;
+
+      PL->data = NULL;
+    }
+
+    if (DEH->identifier == X3F_SECi) {
+      x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+
+      cleanup_huffman(&x3f->info, &ID->huffman);
+
+      cleanup_true(&x3f->info, &ID->tru);
+
+      cleanup_quattro(&x3f->info, &ID->quattro);
+
+      cleanup_true_index(&ID->true_index);
+
+      ID->data = NULL;
+    }
+
+    if (DEH->identifier == X3F_SECc) {
+      x3f_camf_t *CAMF = &DEH->data_subsection.camf;
+
+      CAMF->data = NULL;
+      FREE(CAMF->decoded_data);
+    }
+  }
+
+  free_chunks(&x3f->info);
+  unmap_input(&x3f->info);
+  if (x3f->info.decoder != NULL) {
+    x3f_arena_reset(&x3f->info.arena);
+    x3f_arena_move_spare(&x3f->info.decoder->arena, &x3f->info.arena);
+  }
+  x3f_arena_free(&x3f->info.arena);
+  FREE(x3f);
+
+  return X3F_OK;
+}
+
+/* --------------------------------------------------------------------- */
+/* Probing a file                                                        */
+/* --------------------------------------------------------------------- */
+
+/* extern */ x3f_return_t x3f_probe(FILE *infile, x3f_probe_t *P)
+{
+  x3f_t *x3f;
+  x3f_directory_section_t *DS;
+  x3f_directory_entry_t *DE;
+  int d;
+
+  memset(P, 0, sizeof(x3f_probe_t));
+
+  if (infile == NULL)
+    return X3F_ARGUMENT_ERROR;
+
+  /* The few small reads of the parsing are cheaper than mapping the
+     file */
+  x3f = new_from_file(infile, 0);
+  if (x3f == NULL)
+    return X3F_INFILE_ERROR;
+
+  P->version = x3f->header.version;
+  P->columns = x3f->header.columns;
+  P->rows = x3f->header.rows;
+  P->rotation = x3f->header.rotation;
+  memcpy(P->white_balance, x3f->header.white_balance, SIZE_WHITE_BALANCE);
+
+  if ((DE = x3f_get_raw(x3f)) != NULL) {
+    x3f_image_data_t *ID = &DE->header.data_subsection.image_data;
+
+    P->raw_type_format = ID->type_format;
+    P->raw_columns = ID->columns;
+    P->raw_rows = ID->rows;
+  }
+
+  DS = &x3f->directory_section;
+  P->num_sections = DS->num_directory_entries;
+
+  for (d=0; d<DS->num_directory_entries && d<X3F_PROBE_MAX_SECTIONS; d++) {
+    x3f_probe_section_t *S = &P->section[d];
+
+    DE = &DS->directory_entry[d];
+    S->type = DE->header.identifier;
+    S->size = DE->input.size;
+
+    if (S->type == X3F_SECi) {
+      x3f_image_data_t *ID = &DE->header.data_subsection.image_data;
+
+      S->type_format = ID->type_format;
+      S->columns = ID->columns;
+      S->rows = ID->rows;
+    }
+  }
+
+  x3f_delete(x3f);
+
+  return X3F_OK;
+}
+
+/* --------------------------------------------------------------------- */
+/* Decoders, for reusing memory between x3f                              */
+/* --------------------------------------------------------------------- */
+
+/* extern */ x3f_decoder_t *x3f_new_decoder(void)
+{
+  return (x3f_decoder_t *)calloc(1, sizeof(x3f_decoder_t));
+}
+
+/* extern */ void x3f_delete_decoder(x3f_decoder_t *D)
+{
+  int i;
+
+  if (D == NULL) return;
+
+  for (i=0; i<X3F_DECODER_BUFFERS; i++)
+    FREE(D->buffer[i].data);
+  x3f_arena_free(&D->arena);
+  FREE(D);
+}
+
+/* extern */ void x3f_use_decoder(x3f_t *x3f, x3f_decoder_t *D)
+{
+  x3f->info.decoder = D;
+  if (D != NULL)
+    x3f_arena_move_spare(&x3f->info.arena, &D->arena);
+}
+
+/* --------------------------------------------------------------------- */
+/* Getting a reference to a directory entry                              */
+/* --------------------------------------------------------------------- */
+
+/* TODO: all those only get the first instance */
+
+static x3f_directory_entry_t *x3f_get(x3f_t *x3f,
+                                      uint32_t type,
+                                      uint32_t image_type)
+{
+  x3f_directory_section_t *DS;
+  int d;
+
+  if (x3f == NULL) return NULL;
+
+  DS = &x3f->directory_section;
+
+  for (d=0; d<DS->num_directory_entries; d++) {
+    x3f_directory_entry_t *DE = &DS->directory_entry[d];
+    x3f_directory_entry_header_t *DEH = &DE->header;
+
+    if (DEH->identifier == type) {
+      switch (DEH->identifier) {
+      case X3F_SECi:
+        {
+          x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+
+          if (ID->type_format == image_type)
+            return DE;
+        }
+        break;
+      default:
+        return DE;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_raw(x3f_t *x3f)
+{
+  x3f_directory_entry_t *DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_X530)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_HUFFMAN_10BIT)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_TRUE)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_MERRILL)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_QUATTRO)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQ)) != NULL)
+    return DE;
+
+  if ((DE = x3f_get(x3f, X3F_SECi, X3F_IMAGE_RAW_SDQH)) != NULL)
+    return DE;
+
+  return NULL;
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_thumb_plain(x3f_t *x3f)
+{
+  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_PLAIN);
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_thumb_huffman(x3f_t *x3f)
+{
+  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_HUFFMAN);
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_thumb_jpeg(x3f_t *x3f)
+{
+  return x3f_get(x3f, X3F_SECi, X3F_IMAGE_THUMB_JPEG);
+}
+
+/* extern */ x3f_directory_entry_t *x3f_get_camf(x3f_t *x3f)
 {
   return x3f_get(x3f, X3F_SECc, 0);
 }
@@ -655,6 +1480,68 @@ static void add_code_to_tree(x3f_hufftree_t *tree,
   t->leaf = value;
 }
 
+/* Make the lookup table from the tree. Each entry is indexed by the
+   next HUF_LUT_BITS bits of the stream. For TRUE coding the leaf is
+   the number of difference bits that follows the code. If those also
+   fit, the entry holds the complete difference. Entries for codes
+   that are too long, or for invalid codes, are left with length 0 so
+   that the decoder falls back to walking the tree. */
+
+static void populate_huffman_lut(x3f_hufftree_t *tree, bool_t true_diff)
+{
+  uint32_t i;
+
+  for (i=0; i<HUF_LUT_SIZE; i++) {
+    x3f_hufflut_t *entry = &tree->lut[i];
+    x3f_huffnode_t *node = &tree->nodes[0];
+    int length = 0;
+    uint8_t bits;
+
+    entry->value = 0;
+    entry->length = 0;
+    entry->diff_bits = 0;
+
+    while (node->branch[0] != NULL || node->branch[1] != NULL) {
+      int bit;
+
+      if (length == HUF_LUT_BITS) break;
+
+      bit = (i>>PATTERN_BIT_POS(HUF_LUT_BITS, length))&1;
+      node = node->branch[bit];
+      length++;
+      if (node == NULL) break;
+    }
+
+    if (node == NULL || length == 0 ||
+	node->branch[0] != NULL || node->branch[1] != NULL)
+      continue;
+
+    if (!true_diff) {
+      entry->value = node->leaf;
+      entry->length = length;
+      continue;
+    }
+
+    bits = node->leaf;
+
+    if (bits == 0) {
+      entry->length = length;
+    } else if (length + bits <= HUF_LUT_BITS) {
+      uint32_t pos = PATTERN_BIT_POS(HUF_LUT_BITS, length + bits - 1);
+      int32_t diff = (i>>pos)&((1<<bits) - 1);
+
+      if ((diff>>(bits - 1)) == 0)
+	diff -= (1<<bits) - 1;
+
+      entry->value = diff;
+      entry->length = length + bits;
+    } else if (bits <= HUF_LUT_MAX_DIFF_BITS) {
+      entry->length = length;
+      entry->diff_bits = bits;
+    }
+  }
+}
+
 static void populate_true_huffman_tree(x3f_hufftree_t *tree,
 				       x3f_true_huffman_t *table)
 {
@@ -684,6 +1571,8 @@ static void populate_true_huffman_tree(x3f_hufftree_t *tree,
 #endif
     }
   }
+
+  populate_huffman_lut(tree, 1);
 }
 
 static void populate_huffman_tree(x3f_hufftree_t *tree,
@@ -723,6 +1612,8 @@ static void populate_huffman_tree(x3f_hufftree_t *tree,
 #endif
     }
   }
+
+  populate_huffman_lut(tree, 0);
 }
 
 #ifdef DBG_PRNT
@@ -744,336 +1635,875 @@ static void print_huffman_tree(x3f_huffnode_t *t, int length, uint32_t code)
 }
 #endif
 
-/* Help machinery for reading bits in a memory */
+/* Help machinery for reading bits in a memory */
+
+/* The bits are kept in a 64 bit buffer with the next bit to read in
+   bit 63. The buffer is refilled with whole bytes, eight at a time
+   when far enough from the end. Bytes beyond the end of the data are
+   read as 0. */
+
+typedef struct bit_state_s {
+  uint8_t *next_address;	/* Next byte to load into the buffer */
+  uint8_t *end_address;		/* End of the data */
+  uint64_t bits;		/* Buffered bits, first bit in bit 63 */
+  int bit_count;		/* Number of valid bits in the buffer */
+} bit_state_t;
+
+static void set_bit_state(bit_state_t *BS, uint8_t *address, uint8_t *end)
+{
+  BS->next_address = address;
+  BS->end_address = end;
+  BS->bits = 0;
+  BS->bit_count = 0;
+}
+
+/* Fill the buffer to at least 56 bits. When reading eight bytes at a
+   time the bits below bit_count also get (correct) data from the
+   following byte. That is OK as that byte is later ORed in at the
+   same position. */
+
+static void fill_bits(bit_state_t *BS)
+{
+  uint8_t *p = BS->next_address;
+
+  if (BS->end_address - p >= 8) {
+    uint64_t word =
+      ((uint64_t)p[0]<<56) | ((uint64_t)p[1]<<48) |
+      ((uint64_t)p[2]<<40) | ((uint64_t)p[3]<<32) |
+      ((uint64_t)p[4]<<24) | ((uint64_t)p[5]<<16) |
+      ((uint64_t)p[6]<<8)  | ((uint64_t)p[7]<<0);
+    int bytes = (63 - BS->bit_count)>>3;
+
+    BS->bits |= word>>BS->bit_count;
+    BS->next_address += bytes;
+    BS->bit_count += bytes<<3;
+  } else {
+    while (BS->bit_count <= 56) {
+      uint64_t byte = p < BS->end_address ? *p : 0;
+
+      BS->bits |= byte<<(56 - BS->bit_count);
+      p++;
+      BS->bit_count += 8;
+    }
+    BS->next_address = p;
+  }
+}
+
+/* Look at the next n (1 to 56) bits without consuming them */
+
+static uint32_t peek_bits(bit_state_t *BS, int n)
+{
+  if (BS->bit_count < n)
+    fill_bits(BS);
+
+  return (uint32_t)(BS->bits>>(64 - n));
+}
+
+/* Consume n bits, at most as many as were just peeked at */
+
+static void skip_bits(bit_state_t *BS, int n)
+{
+  BS->bits <<= n;
+  BS->bit_count -= n;
+}
+
+static uint8_t get_bit(bit_state_t *BS)
+{
+  uint8_t bit = peek_bits(BS, 1);
+
+  skip_bits(BS, 1);
+
+  return bit;
+}
+
+/* Slow path - walk the tree bit by bit. Returns NULL for a bit
+   sequence that is not in the tree. */
+
+static x3f_huffnode_t *walk_huffman_tree(bit_state_t *BS,
+					 x3f_hufftree_t *HTP)
+{
+  x3f_huffnode_t *node = &HTP->nodes[0];
+
+  while (node->branch[0] != NULL || node->branch[1] != NULL) {
+    uint8_t bit = get_bit(BS);
+    x3f_huffnode_t *new_node = node->branch[bit];
+
+    node = new_node;
+    if (node == NULL) {
+      /* TODO: Shouldn't this be treated as a fatal error? */
+      x3f_printf(ERR, "Huffman coding got unexpected bit\n");
+      return NULL;
+    }
+  }
+
+  return node;
+}
+
+/* Decode use the TRUE algorithm */
+
+static int32_t get_true_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
+{
+  x3f_hufflut_t *entry = &HTP->lut[peek_bits(BS, HUF_LUT_BITS)];
+  int32_t diff;
+  uint8_t bits;
+
+  if (entry->length != 0) {
+    skip_bits(BS, entry->length);
+    if (entry->diff_bits == 0)
+      return entry->value;
+    bits = entry->diff_bits;
+  } else {
+    x3f_huffnode_t *node = walk_huffman_tree(BS, HTP);
+
+    if (node == NULL)
+      return 0;
+    bits = node->leaf;
+    if (bits == 0)
+      return 0;
+  }
+
+  if (bits <= HUF_LUT_MAX_DIFF_BITS) {
+    diff = peek_bits(BS, bits);
+    skip_bits(BS, bits);
+
+    if ((diff>>(bits - 1)) == 0)
+      diff -= (1<<bits) - 1;
+  } else {
+    uint8_t first_bit = get_bit(BS);
+    int i;
+
+    diff = first_bit;
+
+    for (i=1; i<bits; i++)
+      diff = (diff << 1) + get_bit(BS);
+
+    if (first_bit == 0)
+      diff -= (1<<bits) - 1;
+  }
+
+  return diff;
+}
+
+/* Clip the decoded region to an image of the given size. Returns 0
+   if nothing is left of it. */
+
+static int clip_region(uint32_t *region, uint32_t columns, uint32_t rows)
+{
+  if (columns == 0 || rows == 0)
+    return 0;
+
+  if (region[2] >= columns) region[2] = columns - 1;
+  if (region[3] >= rows) region[3] = rows - 1;
+
+  return region[0] <= region[2] && region[1] <= region[3];
+}
+
+/* The part of a TRUE plane that is stored. Plane 2 in the Quattro
+   layout has twice the resolution of the others. */
+
+static void true_plane_region(x3f_image_data_t *ID, int color, uint32_t *rect)
+{
+  x3f_quattro_t *Q = ID->quattro;
+
+  if (Q != NULL && Q->quattro_layout && color == 2) {
+    rect[0] = 2*ID->region[0];
+    rect[1] = 2*ID->region[1];
+    rect[2] = 2*ID->region[2] + 1;
+    rect[3] = 2*ID->region[3] + 1;
+    clip_region(rect, Q->plane[2].columns, Q->plane[2].rows);
+  } else
+    memcpy(rect, ID->region, 4*sizeof(uint32_t));
+}
+
+/* This code (that decodes one of the X3F color planes, really is a
+   decoding of a compression algorithm suited for Bayer CFA data. In
+   Bayer CFA the data is divided into 2x2 squares that represents
+   (R,G1,G2,B) data. Those four positions are (in this compression)
+   treated as one data stream each, where you store the differences to
+   previous data in the stream. The reason for this is, of course,
+   that the date is more often than not near to the next data in a
+   stream that represents the same color. */
+
+/* TODO: write more about the compression */
 
-typedef struct bit_state_s {
-  uint8_t *next_address;
-  uint8_t bit_offset;
-  uint8_t bits[8];
-} bit_state_t;
+/* The statistics of the rows of one band, i.e. of one channel of an
+   area. They are added to the area statistics when all bands are
+   decoded. */
 
-static void set_bit_state(bit_state_t *BS, uint8_t *address)
+typedef struct true_stats_s {
+  x3f_area_stats_t *area;	/* NULL if not collected */
+  int channel;
+  uint64_t sum[X3F_STATS_MAX_RECTS];
+  uint64_t sum_sq[X3F_STATS_MAX_RECTS];
+  uint16_t min[X3F_STATS_MAX_RECTS];
+  uint16_t max[X3F_STATS_MAX_RECTS];
+  uint32_t bin[X3F_STATS_HIST_SIZE];
+} true_stats_t;
+
+static void true_stats_init(x3f_image_stats_t *S, x3f_image_data_t *ID,
+			    int color, true_stats_t *T)
 {
-  BS->next_address = address;
-  BS->bit_offset = 8;
+  x3f_quattro_t *Q = ID->quattro;
+  int r;
+
+  memset(T, 0, sizeof(true_stats_t));
+  if (S == NULL) return;
+
+  if (Q != NULL && Q->quattro_layout && color == 2) {
+    T->area = &S->top16;
+    T->channel = 0;
+  } else {
+    T->area = &S->x3rgb16;
+    T->channel = color;
+  }
+
+  for (r=0; r<X3F_STATS_MAX_RECTS; r++)
+    T->min[r] = UINT16_MAX;
 }
 
-static uint8_t get_bit(bit_state_t *BS)
+/* Called with each decoded row, while it is still in the cache */
+static void true_stats_row(true_stats_t *T, uint32_t row,
+			   uint16_t *src, uint32_t step, uint32_t columns)
 {
-  if (BS->bit_offset == 8) {
-    uint8_t byte = *BS->next_address;
-    int i;
+  x3f_area_stats_t *AS = T->area;
+  uint32_t r, col;
+
+  for (r=0; r<AS->num_rects; r++) {
+    uint32_t *rect = AS->rect[r].rect;
+    uint64_t sum = 0, sum_sq = 0;
+    uint16_t min = T->min[r], max = T->max[r];
+
+    if (row < rect[1] || row > rect[3]) continue;
 
-    for (i=7; i>= 0; i--) {
-      BS->bits[i] = byte&1;
-      byte = byte >> 1;
+    for (col = rect[0]; col <= rect[2]; col++) {
+      uint32_t value = src[col*step];
+
+      sum += value;
+      sum_sq += value*value;
+      if (value < min) min = value;
+      if (value > max) max = value;
     }
-    BS->next_address++;
-    BS->bit_offset = 0;
+
+    T->sum[r] += sum;
+    T->sum_sq[r] += sum_sq;
+    T->min[r] = min;
+    T->max[r] = max;
   }
 
-  return BS->bits[BS->bit_offset++];
+  if (AS->histogram)
+    for (col = 0; col < columns; col++)
+      T->bin[src[col*step] >> X3F_STATS_HIST_SHIFT]++;
 }
 
-/* Decode use the TRUE algorithm */
-
-static int32_t get_true_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
+static void true_stats_merge(true_stats_t *T)
 {
-  int32_t diff;
-  x3f_huffnode_t *node = &HTP->nodes[0];
-  uint8_t bits;
+  x3f_area_stats_t *AS = T->area;
+  int c = T->channel;
+  uint32_t r, i;
 
-  while (node->branch[0] != NULL || node->branch[1] != NULL) {
-    uint8_t bit = get_bit(BS);
-    x3f_huffnode_t *new_node = node->branch[bit];
+  if (AS == NULL) return;
 
-    node = new_node;
-    if (node == NULL) {
-      /* TODO: Shouldn't this be treated as a fatal error? */
-      x3f_printf(ERR, "Huffman coding got unexpected bit\n");
-      return 0;
-    }
+  for (r=0; r<AS->num_rects; r++) {
+    x3f_rect_stats_t *R = &AS->rect[r];
+
+    R->sum[c] += T->sum[r];
+    R->sum_sq[c] += T->sum_sq[r];
+    if (T->min[r] < R->min[c]) R->min[c] = T->min[r];
+    if (T->max[r] > R->max[c]) R->max[c] = T->max[r];
   }
 
-  bits = node->leaf;
+  if (AS->histogram)
+    for (i=0; i<X3F_STATS_HIST_SIZE; i++)
+      AS->bin[c][i] += T->bin[i];
+}
 
-  if (bits == 0)
-    diff = 0;
-  else {
-    uint8_t first_bit = get_bit(BS);
-    int i;
+/* Decode the rows of a plane from the checkpoint C, at row, up to
+   and including last. The checkpoints passed on the way, from number
+   record and on, are recorded in the index. Statistics are collected
+   in T, if not NULL. */
 
-    diff = first_bit;
+/* The differences of a TRUE row are decoded first and then added up
+   in place. Even and odd columns are separate streams, seeded by the
+   first two values of the previous row of the same parity, in start,
+   which is updated to the first two values of this row. */
 
-    for (i=1; i<bits; i++)
-      diff = (diff << 1) + get_bit(BS);
+static void true_row_sum(int32_t *v, uint32_t n, int32_t start[2])
+{
+  uint32_t col = 2;
 
-    if (first_bit == 0)
-      diff -= (1<<bits) - 1;
+  if (n == 0) return;
+  v[0] += start[0];
+  start[0] = v[0];
+  if (n == 1) return;
+  v[1] += start[1];
+  start[1] = v[1];
+
+#ifdef __SSE2__
+  {
+    /* Both streams in one vector, as [even, odd, even, odd] */
+    __m128i carry = _mm_set_epi32(v[1], v[0], v[1], v[0]);
+
+    for (; col + 4 <= n; col += 4) {
+      __m128i x = _mm_loadu_si128((__m128i *)&v[col]);
+
+      x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi32(x, carry);
+      _mm_storeu_si128((__m128i *)&v[col], x);
+      carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 2, 3, 2));
+    }
   }
+#endif
 
-  return diff;
+  for (; col < n; col++)
+    v[col] += v[col-2];
 }
 
-/* This code (that decodes one of the X3F color planes, really is a
-   decoding of a compression algorithm suited for Bayer CFA data. In
-   Bayer CFA the data is divided into 2x2 squares that represents
-   (R,G1,G2,B) data. Those four positions are (in this compression)
-   treated as one data stream each, where you store the differences to
-   previous data in the stream. The reason for this is, of course,
-   that the date is more often than not near to the next data in a
-   stream that represents the same color. */
+/* Store n values of a row, keeping the low 16 bits */
 
-/* TODO: write more about the compression */
+static void true_row_store(uint16_t *dst, uint32_t step,
+			   int32_t *v, uint32_t n)
+{
+  uint32_t i = 0;
+
+#ifdef __SSE2__
+  if (step == 1)
+    for (; i + 8 <= n; i += 8) {
+      __m128i a = _mm_loadu_si128((__m128i *)&v[i]);
+      __m128i b = _mm_loadu_si128((__m128i *)&v[i+4]);
+
+      /* Sign extend the low half, so that the saturating pack does
+	 not saturate */
+      a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+      b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+      _mm_storeu_si128((__m128i *)&dst[i], _mm_packs_epi32(a, b));
+    }
+#endif
 
-static void true_decode_one_color(x3f_image_data_t *ID, int color)
+  for (; i < n; i++)
+    dst[i*step] = (uint16_t)v[i];
+}
+
+static void true_decode_rows(x3f_image_data_t *ID, int color,
+			     x3f_true_checkpoint_t *C,
+			     uint32_t row, uint32_t last,
+			     uint32_t record, true_stats_t *T)
 {
   x3f_true_t *TRU = ID->tru;
   x3f_quattro_t *Q = ID->quattro;
-  uint32_t seed = TRU->seed[color]; /* TODO : Is this correct ? */
-  int row;
+  x3f_true_index_t *TI = ID->true_index;
+  uint8_t *plane = TRU->plane_address[color];
+  uint32_t rect[4];
 
   x3f_hufftree_t *tree = &TRU->tree;
   bit_state_t BS;
 
   int32_t row_start_acc[2][2];
-  uint32_t rows = ID->rows;
   uint32_t cols = ID->columns;
   x3f_area16_t *area = &TRU->x3rgb16;
-  uint16_t *dst = area->data + color;
-
-  set_bit_state(&BS, TRU->plane_address[color]);
-
-  row_start_acc[0][0] = seed;
-  row_start_acc[0][1] = seed;
-  row_start_acc[1][0] = seed;
-  row_start_acc[1][1] = seed;
+  uint16_t *row_dst = area->data + X3F_CHANNEL_STRIDE(area)*color;
+  uint32_t step;
+  int32_t *values;
 
-  if (ID->type_format == X3F_IMAGE_RAW_QUATTRO ||
-      ID->type_format == X3F_IMAGE_RAW_SDQ ||
-      ID->type_format == X3F_IMAGE_RAW_SDQH) {
-    rows = Q->plane[color].rows;
+  if (Q != NULL) {
     cols = Q->plane[color].columns;
 
     if (Q->quattro_layout && color == 2) {
       area = &Q->top16;
-      dst = area->data;
+      row_dst = area->data;
     }
-    x3f_printf(DEBUG, "Quattro decode one color (%d) rows=%d cols=%d\n",
-	       color, rows, cols);
-  } else {
-    x3f_printf(DEBUG, "TRUE decode one color (%d) rows=%d cols=%d\n",
-	       color, rows, cols);
   }
 
-  assert(rows == area->rows && cols >= area->columns);
+  true_plane_region(ID, color, rect);
+  assert(rect[2] < cols && last <= rect[3]);
+  assert(rect[2] - rect[0] + 1 == area->columns &&
+	 rect[3] - rect[1] + 1 == area->rows);
 
-  for (row = 0; row < rows; row++) {
-    int col;
+  if (row > rect[1])
+    row_dst += (row - rect[1])*area->row_stride;
+  step = X3F_PIXEL_STRIDE(area);
+
+  set_bit_state(&BS, plane + C->bit_offset/8,
+		(uint8_t *)ID->data + ID->data_size);
+  if (C->bit_offset%8 != 0) {
+    peek_bits(&BS, 8);
+    skip_bits(&BS, C->bit_offset%8);
+  }
+
+  memcpy(row_start_acc, C->row_start_acc, sizeof(row_start_acc));
+
+  values = (int32_t *)malloc(cols*sizeof(int32_t));
+
+  for (; row <= last; row++) {
+    uint32_t col;
     bool_t odd_row = row&1;
-    int32_t acc[2];
+    uint32_t first = row >= rect[1] ? rect[0] : cols;
+    uint32_t end = row == rect[3] ? rect[2] + 1 : cols;
 
-    for (col = 0; col < cols; col++) {
-      bool_t odd_col = col&1;
-      int32_t diff = get_true_diff(&BS, tree);
-      int32_t prev = col < 2 ?
-	row_start_acc[odd_row][odd_col] :
-	acc[odd_col];
-      int32_t value = prev + diff;
+    if (TI != NULL && row%TI->interval == 0 && row/TI->interval >= record) {
+      x3f_true_checkpoint_table_t *table = &TI->checkpoint[color];
+      x3f_true_checkpoint_t *R = &table->element[row/TI->interval];
 
-      acc[odd_col] = value;
-      if (col < 2)
-	row_start_acc[odd_row][odd_col] = value;
+      R->bit_offset = (BS.next_address - plane)*8 - BS.bit_count;
+      memcpy(R->row_start_acc, row_start_acc, sizeof(row_start_acc));
+      table->size = row/TI->interval + 1;
+    }
 
-      /* Discard additional data at the right for binned Quattro plane 2 */
-      if (col >= area->columns) continue;
+    for (col = 0; col < end; col++)
+      values[col] = get_true_diff(&BS, tree);
 
-      *dst = value;
-      dst += area->channels;
+    true_row_sum(values, end, row_start_acc[odd_row]);
+
+    if (row >= rect[1]) {
+      /* Also discards additional data at the right for binned
+	 Quattro plane 2 */
+      true_row_store(row_dst, step, &values[first], area->columns);
+      if (T != NULL)
+	true_stats_row(T, row - rect[1], row_dst, step, area->columns);
+      row_dst += area->row_stride;
     }
   }
+
+  free(values);
+}
+
+/* A band is a number of rows in one plane, starting at a checkpoint
+   or at the start of the plane. */
+
+typedef struct true_band_s {
+  int color;
+  uint32_t first;
+  uint32_t last;
+  uint32_t record;		/* First checkpoint not yet in the index */
+  x3f_true_checkpoint_t start;
+  true_stats_t stats;
+} true_band_t;
+
+typedef struct true_bands_s {
+  x3f_image_data_t *ID;
+  true_band_t *band;
+} true_bands_t;
+
+static void true_decode_band_job(void *data, int i)
+{
+  true_bands_t *B = (true_bands_t *)data;
+  true_band_t *band = &B->band[i];
+
+  true_decode_rows(B->ID, band->color, &band->start,
+		   band->first, band->last, band->record,
+		   band->stats.area != NULL ? &band->stats : NULL);
+}
+
+static uint32_t true_plane_rows(x3f_image_data_t *ID, int color)
+{
+  return ID->quattro != NULL ? ID->quattro->plane[color].rows : ID->rows;
 }
 
+/* The planes are independent streams, with their own seed, writing
+   to different channels. So they can be decoded in parallel. With an
+   index, each plane is also split into bands at the checkpoints, and
+   decoding starts at the last checkpoint before the region. */
+
 static void true_decode(x3f_info_t *I,
-			x3f_directory_entry_t *DE)
+			x3f_directory_entry_t *DE,
+			x3f_image_stats_t *S)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
-  int color;
+  x3f_true_t *TRU = ID->tru;
+  x3f_true_index_t *TI = ID->true_index;
+  true_bands_t B;
+  int bands = 0;
+  int color, i;
+
+  B.ID = ID;
+  B.band = (true_band_t *)malloc(TRUE_PLANES*sizeof(true_band_t));
+
+  for (color = 0; color < TRUE_PLANES; color++) {
+    uint32_t recorded = TI != NULL ? TI->checkpoint[color].size : 0;
+    uint32_t rect[4];
+    true_band_t *band;
+
+    if (!(ID->planes & X3F_PLANE(color))) {
+      x3f_printf(DEBUG, "Skip decoding color (%d)\n", color);
+      continue;
+    }
 
-  for (color = 0; color < 3; color++) {
-    true_decode_one_color(ID, color);
+    x3f_printf(DEBUG, "%s decode one color (%d) rows=%d cols=%d\n",
+	       ID->quattro != NULL ? "Quattro" : "TRUE", color,
+	       true_plane_rows(ID, color),
+	       ID->quattro != NULL ?
+	       ID->quattro->plane[color].columns : ID->columns);
+
+    true_plane_region(ID, color, rect);
+
+    if (recorded == 0) {
+      uint32_t seed = TRU->seed[color]; /* TODO : Is this correct ? */
+
+      band = &B.band[bands++];
+      band->color = color;
+      true_stats_init(S, ID, color, &band->stats);
+      band->first = 0;
+      band->last = rect[3];
+      band->record = 0;
+      band->start.bit_offset = 0;
+      band->start.row_start_acc[0][0] = seed;
+      band->start.row_start_acc[0][1] = seed;
+      band->start.row_start_acc[1][0] = seed;
+      band->start.row_start_acc[1][1] = seed;
+    } else {
+      uint32_t k = rect[1]/TI->interval;
+
+      if (k >= recorded)
+	k = recorded - 1;
+
+      B.band = (true_band_t *)
+	realloc(B.band,
+		(bands + TRUE_PLANES + rect[3]/TI->interval - k + 1)*
+		sizeof(true_band_t));
+
+      for (;; k++) {
+	band = &B.band[bands++];
+	band->color = color;
+	true_stats_init(S, ID, color, &band->stats);
+	band->first = k*TI->interval;
+	band->record = recorded;
+	band->start = TI->checkpoint[color].element[k];
+
+	if (k + 1 < recorded && (k + 1)*TI->interval <= rect[3]) {
+	  band->last = (k + 1)*TI->interval - 1;
+	} else {
+	  band->last = rect[3];
+	  break;
+	}
+      }
+    }
   }
+
+  x3f_printf(DEBUG, "TRUE decode in %d bands\n", bands);
+  x3f_run_jobs(bands, true_decode_band_job, &B);
+
+  for (i=0; i<bands; i++)
+    true_stats_merge(&B.band[i].stats);
+
+  free(B.band);
 }
 
 /* Decode use the huffman tree */
 
 static int32_t get_huffman_diff(bit_state_t *BS, x3f_hufftree_t *HTP)
 {
-  int32_t diff;
-  x3f_huffnode_t *node = &HTP->nodes[0];
-
-  while (node->branch[0] != NULL || node->branch[1] != NULL) {
-    uint8_t bit = get_bit(BS);
-    x3f_huffnode_t *new_node = node->branch[bit];
+  x3f_hufflut_t *entry = &HTP->lut[peek_bits(BS, HUF_LUT_BITS)];
+  x3f_huffnode_t *node;
 
-    node = new_node;
-    if (node == NULL) {
-      /* TODO: Shouldn't this be treated as a fatal error? */
-      x3f_printf(ERR, "Huffman coding got unexpected bit\n");
-      return 0;
-    }
+  if (entry->length != 0) {
+    skip_bits(BS, entry->length);
+    return entry->value;
   }
 
-  diff = node->leaf;
+  node = walk_huffman_tree(BS, HTP);
+  if (node == NULL)
+    return 0;
 
-  return diff;
+  return node->leaf;
 }
 
+/* The row is decoded to signed values, i.e. without clamping. That is
+   done afterwards in huffman_fix_row, when the offset is known. */
+
 static void huffman_decode_row(x3f_info_t *I,
                                x3f_directory_entry_t *DE,
                                int bits,
                                int row,
                                int offset,
+                               int16_t *values,
                                int *minimum)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
   x3f_huffman_t *HUF = ID->huffman;
 
+  uint32_t *region = ID->region;
+  uint32_t columns = region[2] - region[0] + 1;
   int16_t c[3] = {offset,offset,offset};
+  int16_t *dst = values + 3*(row - region[1])*columns;
   int col;
   bit_state_t BS;
 
-  set_bit_state(&BS, ID->data + HUF->row_offsets.element[row]);
+  set_bit_state(&BS, ID->data + HUF->row_offsets.element[row],
+		ID->data + ID->data_size);
 
-  for (col = 0; col < ID->columns; col++) {
+  /* Columns left of the region are only needed for the sums */
+  for (col = 0; col < region[0]; col++) {
     int color;
 
-    for (color = 0; color < 3; color++) {
-      uint16_t c_fix;
+    for (color = 0; color < 3; color++)
+      c[color] += get_huffman_diff(&BS, &HUF->tree);
+  }
+
+  for (; col <= region[2]; col++) {
+    int color;
 
+    for (color = 0; color < 3; color++) {
       c[color] += get_huffman_diff(&BS, &HUF->tree);
-      if (c[color] < 0) {
-        c_fix = 0;
-        if (c[color] < *minimum)
-          *minimum = c[color];
-      } else {
-        c_fix = c[color];
-      }
+      if (c[color] < *minimum)
+	*minimum = c[color];
 
-      switch (ID->type_format) {
-      case X3F_IMAGE_RAW_HUFFMAN_X530:
-      case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-        HUF->x3rgb16.data[3*(row*ID->columns + col) + color] = (uint16_t)c_fix;
-        break;
-      case X3F_IMAGE_THUMB_HUFFMAN:
-        HUF->rgb8.data[3*(row*ID->columns + col) + color] = (uint8_t)c_fix;
-        break;
-      default:
-	/* TODO: Shouldn't this be treated as a fatal error? */
-        x3f_printf(ERR, "Unknown huffman image type\n");
-      }
+      *dst++ = c[color];
     }
   }
 }
 
-static void huffman_decode(x3f_info_t *I,
-                           x3f_directory_entry_t *DE,
-                           int bits)
-{
-  x3f_directory_entry_header_t *DEH = &DE->header;
-  x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+/* The minimum of the signed values of a whole row, without storing
+   them */
 
-  int row;
+static int huffman_row_minimum(x3f_image_data_t *ID, int row, int offset)
+{
+  x3f_huffman_t *HUF = ID->huffman;
+  int16_t c[3] = {offset,offset,offset};
   int minimum = 0;
-  int offset = legacy_offset;
+  int col;
+  bit_state_t BS;
 
-  x3f_printf(DEBUG, "Huffman decode with offset: %d\n", offset);
-  for (row = 0; row < ID->rows; row++)
-    huffman_decode_row(I, DE, bits, row, offset, &minimum);
+  set_bit_state(&BS, ID->data + HUF->row_offsets.element[row],
+		ID->data + ID->data_size);
 
-  if (auto_legacy_offset && minimum < 0) {
-    offset = -minimum;
-    x3f_printf(DEBUG, "Redo with offset: %d\n", offset);
-    for (row = 0; row < ID->rows; row++)
-      huffman_decode_row(I, DE, bits, row, offset, &minimum);
+  for (col = 0; col < ID->columns; col++) {
+    int color;
+
+    for (color = 0; color < 3; color++) {
+      c[color] += get_huffman_diff(&BS, &HUF->tree);
+      if (c[color] < minimum)
+	minimum = c[color];
+    }
   }
+
+  return minimum;
 }
 
-static int32_t get_simple_diff(x3f_huffman_t *HUF, uint16_t index)
+/* Add the offset adjustment to the signed values and clamp negative
+   values to 0. As the decoded values are int16_t sums, this gives
+   exactly the same result as decoding again with the new offset. */
+
+static void huffman_fix_row(x3f_image_data_t *ID,
+			    int row,
+			    int adjust,
+			    int16_t *values)
 {
-  if (HUF->mapping.size == 0)
-    return index;
-  else
-    return HUF->mapping.element[index];
+  x3f_huffman_t *HUF = ID->huffman;
+  uint32_t columns = ID->region[2] - ID->region[0] + 1;
+  uint32_t i = 3*row*columns;
+  uint32_t end = i + 3*columns;
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+    for (; i < end; i++) {
+      int16_t c = values[i] + adjust;
+
+      HUF->x3rgb16.data[i] = c < 0 ? 0 : c;
+    }
+    break;
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    for (; i < end; i++) {
+      int16_t c = values[i] + adjust;
+
+      HUF->rgb8.data[i] = c < 0 ? 0 : c;
+    }
+    break;
+  }
+}
+
+/* Each row starts at its own offset in the data, so the rows can be
+   decoded in parallel, and rows outside the region are never
+   touched. Every row gets its own minimum, which are then merged. The
+   jobs are numbered from the first row in the region. */
+
+typedef struct huffman_rows_s {
+  x3f_info_t *I;
+  x3f_directory_entry_t *DE;
+  int bits;
+  int offset;
+  int adjust;
+  int16_t *values;
+  int *minimum;			/* One per row */
+} huffman_rows_t;
+
+static void huffman_decode_row_job(void *data, int row)
+{
+  huffman_rows_t *R = (huffman_rows_t *)data;
+  x3f_image_data_t *ID = &R->DE->header.data_subsection.image_data;
+
+  R->minimum[row] = 0;
+  huffman_decode_row(R->I, R->DE, R->bits, ID->region[1] + row, R->offset,
+		     R->values, &R->minimum[row]);
+}
+
+static void huffman_minimum_row_job(void *data, int row)
+{
+  huffman_rows_t *R = (huffman_rows_t *)data;
+  x3f_image_data_t *ID = &R->DE->header.data_subsection.image_data;
+
+  R->minimum[row] = huffman_row_minimum(ID, row, R->offset);
 }
 
-static void simple_decode_row(x3f_info_t *I,
-                              x3f_directory_entry_t *DE,
-                              int bits,
-                              int row,
-                              int row_stride)
+static void huffman_fix_row_job(void *data, int row)
+{
+  huffman_rows_t *R = (huffman_rows_t *)data;
+  x3f_image_data_t *ID = &R->DE->header.data_subsection.image_data;
+
+  huffman_fix_row(ID, row, R->adjust, R->values);
+}
+
+/* The data is only entropy decoded once. If a negative value is found
+   and the offset is automatic, the offset needed to get rid of it is
+   added in the fix up pass. For a partial decode, the automatic
+   offset must not depend on the region, or separately decoded parts
+   of the image would not match. The minimum is then taken from an
+   extra entropy pass over the whole image. */
+
+static void huffman_decode(x3f_info_t *I,
+                           x3f_directory_entry_t *DE,
+                           int bits)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
   x3f_huffman_t *HUF = ID->huffman;
+  huffman_rows_t R;
+  uint32_t columns = ID->region[2] - ID->region[0] + 1;
+  uint32_t rows = ID->region[3] - ID->region[1] + 1;
+  uint32_t minimum_rows = rows;
+  int minimum = 0;
+  int row;
 
-  uint32_t *data = (uint32_t *)(ID->data + row*row_stride);
-
-  uint16_t c[3] = {0,0,0};
-  int col;
-
-  uint32_t mask = 0;
+  R.I = I;
+  R.DE = DE;
+  R.bits = bits;
+  R.offset = legacy_offset;
+  R.adjust = 0;
 
-  switch (bits) {
-  case 8:
-    mask = 0x0ff;
-    break;
-  case 9:
-    mask = 0x1ff;
-    break;
-  case 10:
-    mask = 0x3ff;
-    break;
-  case 11:
-    mask = 0x7ff;
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+    /* The signed values are fixed in place */
+    R.values = (int16_t *)HUF->x3rgb16.data;
     break;
-  case 12:
-    mask = 0xfff;
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    R.values = (int16_t *)malloc(3*columns*rows*sizeof(int16_t));
     break;
   default:
     /* TODO: Shouldn't this be treated as a fatal error? */
-    x3f_printf(ERR, "Unknown number of bits: %d\n", bits);
-    mask = 0;
-    break;
+    x3f_printf(ERR, "Unknown huffman image type\n");
+    return;
   }
 
-  for (col = 0; col < ID->columns; col++) {
-    int color;
-    uint32_t val = data[col];
+  R.minimum = (int *)malloc(rows*sizeof(int));
 
-    for (color = 0; color < 3; color++) {
-      uint16_t c_fix;
-      c[color] += get_simple_diff(HUF, (val>>(color*bits))&mask);
+  x3f_printf(DEBUG, "Huffman decode with offset: %d\n", R.offset);
+  x3f_run_jobs(rows, huffman_decode_row_job, &R);
 
-      switch (ID->type_format) {
-      case X3F_IMAGE_RAW_HUFFMAN_X530:
-      case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-        c_fix = (int16_t)c[color] > 0 ? c[color] : 0;
+  if (auto_legacy_offset && (columns < ID->columns || rows < ID->rows)) {
+    x3f_printf(DEBUG, "Find minimum of the whole image\n");
+    minimum_rows = ID->rows;
+    R.minimum = (int *)realloc(R.minimum, minimum_rows*sizeof(int));
+    x3f_run_jobs(minimum_rows, huffman_minimum_row_job, &R);
+  }
 
-        HUF->x3rgb16.data[3*(row*ID->columns + col) + color] = c_fix;
-        break;
-      case X3F_IMAGE_THUMB_HUFFMAN:
-        c_fix = (int8_t)c[color] > 0 ? c[color] : 0;
+  for (row = 0; row < minimum_rows; row++)
+    if (R.minimum[row] < minimum)
+      minimum = R.minimum[row];
 
-        HUF->rgb8.data[3*(row*ID->columns + col) + color] = c_fix;
-        break;
-      default:
-	/* TODO: Shouldn't this be treated as a fatal error? */
-        x3f_printf(ERR, "Unknown huffman image type\n");
-      }
-    }
+  if (auto_legacy_offset && minimum < 0) {
+    x3f_printf(DEBUG, "Adjust to offset: %d\n", -minimum);
+    R.adjust = -minimum - R.offset;
+  }
+
+  if (minimum < 0 || R.values != (int16_t *)HUF->x3rgb16.data)
+    x3f_run_jobs(rows, huffman_fix_row_job, &R);
+
+  if (R.values != (int16_t *)HUF->x3rgb16.data)
+    free(R.values);
+  free(R.minimum);
+}
+
+/* Not compressed data has three values of some bits packed in each
+   uint32_t. Each value is mapped and added to the previous value of
+   the same color in the row. The row decoders are made by a macro,
+   so that the common bit depth and output type combinations get
+   constant shifts and masks. Nothing in the loops branches. Columns
+   first to last are stored, the ones to the left of them are only
+   summed. */
+
+#define SIMPLE_DECODE_ROW(_name, _bits, _type, _stype)			\
+  static void _name(uint32_t *data, uint16_t *map,			\
+		    uint32_t first, uint32_t last, int bits,		\
+		    _type *dst)						\
+  {									\
+    uint32_t mask = (1<<(_bits)) - 1;					\
+    uint16_t c0 = 0, c1 = 0, c2 = 0;					\
+    uint32_t col;							\
+									\
+    for (col = 0; col < first; col++) {					\
+      uint32_t val = data[col];						\
+									\
+      c0 += map[(val>>(0*(_bits)))&mask];				\
+      c1 += map[(val>>(1*(_bits)))&mask];				\
+      c2 += map[(val>>(2*(_bits)))&mask];				\
+    }									\
+									\
+    for (; col <= last; col++) {					\
+      uint32_t val = data[col];						\
+									\
+      c0 += map[(val>>(0*(_bits)))&mask];				\
+      c1 += map[(val>>(1*(_bits)))&mask];				\
+      c2 += map[(val>>(2*(_bits)))&mask];				\
+									\
+      dst[0] = (_stype)c0 > 0 ? c0 : 0;					\
+      dst[1] = (_stype)c1 > 0 ? c1 : 0;					\
+      dst[2] = (_stype)c2 > 0 ? c2 : 0;					\
+      dst += 3;								\
+    }									\
+  }
+
+SIMPLE_DECODE_ROW(simple_decode_row_10_16, 10, uint16_t, int16_t)
+SIMPLE_DECODE_ROW(simple_decode_row_8_8, 8, uint8_t, int8_t)
+SIMPLE_DECODE_ROW(simple_decode_row_n_16, bits, uint16_t, int16_t)
+SIMPLE_DECODE_ROW(simple_decode_row_n_8, bits, uint8_t, int8_t)
+
+typedef struct simple_rows_s {
+  x3f_image_data_t *ID;
+  int bits;
+  int row_stride;
+  uint16_t *map;
+} simple_rows_t;
+
+static void simple_decode_row_job(void *data, int row)
+{
+  simple_rows_t *R = (simple_rows_t *)data;
+  x3f_image_data_t *ID = R->ID;
+  x3f_huffman_t *HUF = ID->huffman;
+  uint32_t *region = ID->region;
+  uint32_t *src =
+    (uint32_t *)(ID->data + (region[1] + row)*R->row_stride);
+  uint32_t start = 3*row*(region[2] - region[0] + 1);
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+    if (R->bits == 10)
+      simple_decode_row_10_16(src, R->map, region[0], region[2], R->bits,
+			      HUF->x3rgb16.data + start);
+    else
+      simple_decode_row_n_16(src, R->map, region[0], region[2], R->bits,
+			     HUF->x3rgb16.data + start);
+    break;
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    if (R->bits == 8)
+      simple_decode_row_8_8(src, R->map, region[0], region[2], R->bits,
+			    HUF->rgb8.data + start);
+    else
+      simple_decode_row_n_8(src, R->map, region[0], region[2], R->bits,
+			    HUF->rgb8.data + start);
+    break;
   }
 }
 
@@ -1084,26 +2514,67 @@ static void simple_decode(x3f_info_t *I,
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
+  x3f_huffman_t *HUF = ID->huffman;
+  simple_rows_t R;
+  uint16_t *identity = NULL;
+
+  if (bits < 8 || bits > 12) {
+    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Unknown number of bits: %d\n", bits);
+    return;
+  }
+
+  switch (ID->type_format) {
+  case X3F_IMAGE_RAW_HUFFMAN_X530:
+  case X3F_IMAGE_RAW_HUFFMAN_10BIT:
+  case X3F_IMAGE_THUMB_HUFFMAN:
+    break;
+  default:
+    /* TODO: Shouldn't this be treated as a fatal error? */
+    x3f_printf(ERR, "Unknown huffman image type\n");
+    return;
+  }
 
-  int row;
+  /* Without mapping table the value is used as is */
+  if (HUF->mapping.size == 0) {
+    int i;
+
+    identity = (uint16_t *)malloc((1<<bits)*sizeof(uint16_t));
+    for (i=0; i<(1<<bits); i++)
+      identity[i] = i;
+  }
+
+  R.ID = ID;
+  R.bits = bits;
+  R.row_stride = row_stride;
+  R.map = identity != NULL ? identity : HUF->mapping.element;
 
-  for (row = 0; row < ID->rows; row++)
-    simple_decode_row(I, DE, bits, row, row_stride);
+  x3f_run_jobs(ID->region[3] - ID->region[1] + 1, simple_decode_row_job, &R);
+
+  free(identity);
 }
 
 /* --------------------------------------------------------------------- */
 /* Loading the data in a directory entry                                 */
 /* --------------------------------------------------------------------- */
 
-/* First you set the offset to where to start reading the data ... */
+/* First you set the offset to where to start reading the data. The
+   whole section is then in memory, read now if it was not before ... */
 
 static void read_data_set_offset(x3f_info_t *I,
                                  x3f_directory_entry_t *DE,
                                  uint32_t header_size)
 {
   uint32_t i_off = DE->input.offset + header_size;
+  x3f_chunk_t *S = &I->input.section;
+
+  S->offset = DE->input.offset;
+  S->size = DE->input.size;
+  S->data = find_chunk(I, S->offset, S->size);
+  if (S->data == NULL)
+    S->data = read_chunk(I, S->offset, S->size);
 
-  fseek(I->input.file, i_off, SEEK_SET);
+  I->input.offset = i_off;
 }
 
 /* ... then you read the data, block for block */
@@ -1113,12 +2584,14 @@ static uint32_t read_data_block(void **data,
                                 x3f_directory_entry_t *DE,
                                 uint32_t footer)
 {
-  uint32_t size =
-    DE->input.size + DE->input.offset - ftell(I->input.file) - footer;
+  x3f_chunk_t *S = &I->input.section;
+  uint32_t offset = I->input.offset;
+  uint32_t size = DE->input.size + DE->input.offset - offset - footer;
 
-  *data = (void *)malloc(size);
+  *data = S->data + (offset - S->offset);
 
-  GETN(*data, size);
+  /* Skip the data, the footer is read after it */
+  I->input.offset += size;
 
   return size;
 }
@@ -1134,17 +2607,17 @@ static void x3f_load_image_verbatim(x3f_info_t *I, x3f_directory_entry_t *DE)
 }
 
 #if defined(_WIN32) || defined (_WIN64)
-static char *utf16le_to_utf8(utf16_t *str)
+static char *utf16le_to_utf8(x3f_arena_t *A, utf16_t *str)
 {
   size_t osize = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
-  char *buf = malloc(osize);
+  char *buf = x3f_arena_alloc(A, osize);
 
   WideCharToMultiByte(CP_UTF8, 0, str, -1, buf, osize, NULL, NULL);
 
   return buf;
 }
 #else
-static char *utf16le_to_utf8(utf16_t *str)
+static char *utf16le_to_utf8(x3f_arena_t *A, utf16_t *str)
 {
   iconv_t ic = iconv_open("UTF-8", "UTF-16LE");
   size_t isize, osize;
@@ -1156,7 +2629,7 @@ static char *utf16le_to_utf8(utf16_t *str)
   isize *= 2;			/* Size in bytes */
   osize = 2*isize;		/* Worst case scenario */
 
-  buf = malloc(osize+1);
+  buf = x3f_arena_alloc(A, osize+1);
   ibuf = (char *)str;
   obuf = buf;
 
@@ -1165,10 +2638,15 @@ static char *utf16le_to_utf8(utf16_t *str)
 
   iconv_close(ic);
 
-  return realloc(buf, obuf-buf+1);
+  return buf;
 }
 #endif
 
+static char *get_property_name(void *table, uint32_t i)
+{
+  return ((x3f_property_t *)table)[i].name_utf8;
+}
+
 static void x3f_load_property_list(x3f_info_t *I, x3f_directory_entry_t *DE)
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
@@ -1186,9 +2664,178 @@ static void x3f_load_property_list(x3f_info_t *I, x3f_directory_entry_t *DE)
 
     P->name = ((utf16_t *)PL->data + P->name_offset);
     P->value = ((utf16_t *)PL->data + P->value_offset);
-    P->name_utf8 = utf16le_to_utf8(P->name);
-    P->value_utf8 = utf16le_to_utf8(P->value);
+    P->name_utf8 = utf16le_to_utf8(&I->arena, P->name);
+    P->value_utf8 = utf16le_to_utf8(&I->arena, P->value);
+  }
+
+  build_name_index(&I->arena, &PL->property_index, PL->num_properties,
+		   get_property_name, PL->property_table.element);
+}
+
+/* Make sure that the index, if any, was recorded for this data and
+   has room for all checkpoints. If not, a new one is recorded. */
+
+/* The checkpoints of a read index must be in the plane and strictly
+   increasing, or decoding would start anywhere */
+
+static int check_true_checkpoints(x3f_true_checkpoint_table_t *table,
+				  uint32_t plane_size)
+{
+  uint32_t j;
+
+  for (j=0; j<table->size; j++) {
+    uint32_t bit_offset = table->element[j].bit_offset;
+
+    if ((uint64_t)bit_offset >= (uint64_t)plane_size*8 ||
+	(j > 0 && bit_offset <= table->element[j-1].bit_offset))
+      return 0;
+  }
+
+  return 1;
+}
+
+static void prepare_true_index(x3f_image_data_t *ID)
+{
+  x3f_true_t *TRU = ID->tru;
+  x3f_true_index_t *TI = ID->true_index;
+  int i;
+
+  if (TI != NULL)
+    for (i=0; i<TRUE_PLANES; i++) {
+      uint32_t rows = true_plane_rows(ID, i);
+
+      if (TI->plane_size[i] != TRU->plane_size.element[i] ||
+	  TI->checkpoint[i].size > (rows + TI->interval - 1)/TI->interval ||
+	  !check_true_checkpoints(&TI->checkpoint[i], TI->plane_size[i])) {
+	x3f_printf(WARN, "TRUE index does not match the data, ignored\n");
+	cleanup_true_index(&ID->true_index);
+	break;
+      }
+    }
+
+  if (ID->true_index == NULL) {
+    if (true_checkpoint_interval == 0)
+      return;
+    TI = new_true_index(&ID->true_index, true_checkpoint_interval);
+  }
+
+  for (i=0; i<TRUE_PLANES; i++) {
+    uint32_t rows = true_plane_rows(ID, i);
+    uint32_t num = (rows + TI->interval - 1)/TI->interval;
+    x3f_true_checkpoint_t *element = (x3f_true_checkpoint_t *)
+      realloc(TI->checkpoint[i].element, num*sizeof(x3f_true_checkpoint_t));
+
+    if (element == NULL) {
+      x3f_printf(WARN, "Could not allocate TRUE index, not used\n");
+      cleanup_true_index(&ID->true_index);
+      return;
+    }
+
+    TI->plane_size[i] = TRU->plane_size.element[i];
+    TI->checkpoint[i].element = element;
+  }
+}
+
+/* With true_planar, the planes are decoded into one contiguous plane
+   each instead of being interleaved. Each plane is then written
+   sequentially. NOTE: Denoising and Quattro expansion need interleaved
+   data, so x3f_get_image then interleaves it into a new buffer. That
+   costs more than decoding interleaved, so planar only pays off for
+   output that is unprocessed or not denoised. */
+
+static void set_true_strides(x3f_area16_t *area)
+{
+  if (true_planar) {
+    area->row_stride = area->columns;
+    area->plane_stride = area->columns * area->rows;
+  } else {
+    area->row_stride = area->columns * area->channels;
+    area->plane_stride = 0;
+  }
+}
+
+/* The x3rgb16 area of TRUE data. It is the caller's memory of the
+   decoder if there is any and the image fits in it. */
+static void new_true_area(x3f_info_t *I, x3f_area16_t *area,
+			  uint32_t columns, uint32_t rows)
+{
+  x3f_area16_t *image = I->decoder ? &I->decoder->image : NULL;
+
+  area->columns = columns;
+  area->rows = rows;
+  area->channels = 3;
+
+  if (image != NULL && image->data != NULL) {
+    if (image->channels == 3 &&
+	image->columns >= columns && image->rows >= rows) {
+      area->row_stride = image->row_stride;
+      area->plane_stride = image->plane_stride;
+      area->data = image->data;
+      area->buf = NULL;
+      return;
+    }
+
+    x3f_printf(WARN, "Image (%ux%u) does not fit in the caller's area\n",
+	       columns, rows);
+  }
+
+  set_true_strides(area);
+  area->data = area->buf =
+    (uint16_t *)get_buffer(I, AREA_SIZE(*area, uint16_t));
+}
+
+static int check_area_stats(x3f_area_stats_t *AS, x3f_area16_t *area)
+{
+  uint32_t r;
+  int c;
+
+  if (AS->num_rects > X3F_STATS_MAX_RECTS) return 0;
+
+  for (r=0; r<AS->num_rects; r++) {
+    x3f_rect_stats_t *R = &AS->rect[r];
+    uint32_t *rect = R->rect;
+
+    if (rect[0] > rect[2] || rect[1] > rect[3] ||
+	rect[2] >= area->columns || rect[3] >= area->rows)
+      return 0;
+
+    R->pixels = (rect[2] - rect[0] + 1)*(rect[3] - rect[1] + 1);
+    for (c=0; c<3; c++) {
+      R->sum[c] = 0;
+      R->sum_sq[c] = 0;
+      R->min[c] = UINT16_MAX;
+      R->max[c] = 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Let the setup set the rects, now that the sizes of the areas are
+   known. Returns NULL if no statistics are to be collected. */
+
+static x3f_image_stats_t *setup_stats(x3f_image_data_t *ID)
+{
+  x3f_image_stats_t *S = ID->stats;
+  x3f_quattro_t *Q = ID->quattro;
+  x3f_area16_t *top16 = Q != NULL && Q->quattro_layout ? &Q->top16 : NULL;
+
+  if (S == NULL || S->setup == NULL) return NULL;
+
+  memset(&S->x3rgb16, 0, sizeof(x3f_area_stats_t));
+  memset(&S->top16, 0, sizeof(x3f_area_stats_t));
+
+  if (!S->setup(S->data, S, &ID->tru->x3rgb16, top16))
+    return NULL;
+
+  if (!check_area_stats(&S->x3rgb16, &ID->tru->x3rgb16) ||
+      (top16 != NULL ?
+       !check_area_stats(&S->top16, top16) : S->top16.num_rects > 0)) {
+    x3f_printf(WARN, "Statistics rects outside of image, not collected\n");
+    return NULL;
   }
+
+  return S;
 }
 
 static void x3f_load_true(x3f_info_t *I,
@@ -1196,16 +2843,20 @@ static void x3f_load_true(x3f_info_t *I,
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
-  x3f_true_t *TRU = new_true(&ID->tru);
+  x3f_true_t *TRU = new_true(I, &ID->tru);
   x3f_quattro_t *Q = NULL;
+  x3f_image_stats_t *S;
   int i;
 
+  if (ID->stats != NULL)
+    ID->stats->collected = 0;
+
   if (ID->type_format == X3F_IMAGE_RAW_QUATTRO ||
       ID->type_format == X3F_IMAGE_RAW_SDQ ||
       ID->type_format == X3F_IMAGE_RAW_SDQH) {
     x3f_printf(DEBUG, "Load Quattro extra info\n");
 
-    Q = new_quattro(&ID->quattro);
+    Q = new_quattro(I, &ID->quattro);
 
     for (i=0; i<TRUE_PLANES; i++) {
       GET2(Q->plane[i].columns);
@@ -1248,7 +2899,7 @@ static void x3f_load_true(x3f_info_t *I,
   ID->data_size = read_data_block(&ID->data, I, DE, 0);
 
   /* TODO: can it be fewer than 8 bits? Maybe taken from TRU->table? */
-  new_huffman_tree(&TRU->tree, 8);
+  new_huffman_tree(&I->arena, &TRU->tree, 8);
 
   populate_true_huffman_tree(&TRU->tree, &TRU->table);
 
@@ -1266,41 +2917,53 @@ static void x3f_load_true(x3f_info_t *I,
 	ID->type_format == X3F_IMAGE_RAW_SDQ ||
 	ID->type_format == X3F_IMAGE_RAW_SDQH ) &&
        Q->quattro_layout) {
-    uint32_t columns = Q->plane[0].columns;
-    uint32_t rows = Q->plane[0].rows;
-    uint32_t channels = 3;
-    uint32_t size = columns * rows * channels;
-
-    TRU->x3rgb16.columns = columns;
-    TRU->x3rgb16.rows = rows;
-    TRU->x3rgb16.channels = channels;
-    TRU->x3rgb16.row_stride = columns * channels;
-    TRU->x3rgb16.data = TRU->x3rgb16.buf =
-      (uint16_t *)malloc(sizeof(uint16_t)*size);
-
-    columns = Q->plane[2].columns;
-    rows = Q->plane[2].rows;
+    uint32_t rect[4];
+    uint32_t columns, rows, channels, size;
+
+    if (!clip_region(ID->region, Q->plane[0].columns, Q->plane[0].rows)) {
+      x3f_printf(ERR, "Image region outside of image\n");
+      return;
+    }
+
+    columns = ID->region[2] - ID->region[0] + 1;
+    rows = ID->region[3] - ID->region[1] + 1;
+    if (ID->planes & (X3F_PLANE(0) | X3F_PLANE(1)))
+      new_true_area(I, &TRU->x3rgb16, columns, rows);
+
+    true_plane_region(ID, 2, rect);
+    columns = rect[2] - rect[0] + 1;
+    rows = rect[3] - rect[1] + 1;
     channels = 1;
     size = columns * rows * channels;
 
-    Q->top16.columns = columns;
-    Q->top16.rows = rows;
-    Q->top16.channels = channels;
-    Q->top16.row_stride = columns * channels;
-    Q->top16.data = Q->top16.buf =
-      (uint16_t *)malloc(sizeof(uint16_t)*size);
+    if (ID->planes & X3F_PLANE(2)) {
+      Q->top16.columns = columns;
+      Q->top16.rows = rows;
+      Q->top16.channels = channels;
+      Q->top16.row_stride = columns * channels;
+      Q->top16.plane_stride = 0;
+      Q->top16.data = Q->top16.buf =
+	(uint16_t *)get_buffer(I, sizeof(uint16_t)*size);
+    }
   } else {
-    uint32_t size = ID->columns * ID->rows * 3;
+    uint32_t columns, rows;
+
+    if (!clip_region(ID->region, ID->columns, ID->rows)) {
+      x3f_printf(ERR, "Image region outside of image\n");
+      return;
+    }
 
-    TRU->x3rgb16.columns = ID->columns;
-    TRU->x3rgb16.rows = ID->rows;
-    TRU->x3rgb16.channels = 3;
-    TRU->x3rgb16.row_stride = ID->columns * 3;
-    TRU->x3rgb16.data = TRU->x3rgb16.buf =
-      (uint16_t *)malloc(sizeof(uint16_t)*size);
+    columns = ID->region[2] - ID->region[0] + 1;
+    rows = ID->region[3] - ID->region[1] + 1;
+    new_true_area(I, &TRU->x3rgb16, columns, rows);
   }
 
-  true_decode(I, DE);
+  prepare_true_index(ID);
+
+  S = ID->planes == X3F_PLANES_ALL ? setup_stats(ID) : NULL;
+  true_decode(I, DE, S);
+  if (S != NULL)
+    S->collected = 1;
 }
 
 static void x3f_load_huffman_compressed(x3f_info_t *I,
@@ -1323,7 +2986,7 @@ static void x3f_load_huffman_compressed(x3f_info_t *I,
   GET_TABLE(HUF->row_offsets, GET4, ID->rows);
 
   x3f_printf(DEBUG, "Make huffman tree ...\n");
-  new_huffman_tree(&HUF->tree, bits);
+  new_huffman_tree(&I->arena, &HUF->tree, bits);
   populate_huffman_tree(&HUF->tree, &HUF->table, &HUF->mapping);
   x3f_printf(DEBUG, "... DONE\n");
 
@@ -1358,8 +3021,16 @@ static void x3f_load_huffman(x3f_info_t *I,
 {
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_image_data_t *ID = &DEH->data_subsection.image_data;
-  x3f_huffman_t *HUF = new_huffman(&ID->huffman);
-  uint32_t size;
+  x3f_huffman_t *HUF = new_huffman(I, &ID->huffman);
+  uint32_t columns, rows, size;
+
+  if (!clip_region(ID->region, ID->columns, ID->rows)) {
+    x3f_printf(ERR, "Image region outside of image\n");
+    return;
+  }
+
+  columns = ID->region[2] - ID->region[0] + 1;
+  rows = ID->region[3] - ID->region[1] + 1;
 
   if (use_map_table) {
     int table_size = 1<<bits;
@@ -1370,22 +3041,23 @@ static void x3f_load_huffman(x3f_info_t *I,
   switch (ID->type_format) {
   case X3F_IMAGE_RAW_HUFFMAN_X530:
   case X3F_IMAGE_RAW_HUFFMAN_10BIT:
-    size = ID->columns * ID->rows * 3;
-    HUF->x3rgb16.columns = ID->columns;
-    HUF->x3rgb16.rows = ID->rows;
+    size = columns * rows * 3;
+    HUF->x3rgb16.columns = columns;
+    HUF->x3rgb16.rows = rows;
     HUF->x3rgb16.channels = 3;
-    HUF->x3rgb16.row_stride = ID->columns * 3;
+    HUF->x3rgb16.row_stride = columns * 3;
+    HUF->x3rgb16.plane_stride = 0;
     HUF->x3rgb16.data = HUF->x3rgb16.buf =
-      (uint16_t *)malloc(sizeof(uint16_t)*size);
+      (uint16_t *)get_buffer(I, sizeof(uint16_t)*size);
     break;
   case X3F_IMAGE_THUMB_HUFFMAN:
-    size = ID->columns * ID->rows * 3;
-    HUF->rgb8.columns = ID->columns;
-    HUF->rgb8.columns = ID->rows;
+    size = columns * rows * 3;
+    HUF->rgb8.columns = columns;
+    HUF->rgb8.rows = rows;
     HUF->rgb8.channels = 3;
-    HUF->rgb8.row_stride = ID->columns * 3;
+    HUF->rgb8.row_stride = columns * 3;
     HUF->rgb8.data = HUF->rgb8.buf =
-      (uint8_t *)malloc(sizeof(uint8_t)*size);
+      (uint8_t *)get_buffer(I, sizeof(uint8_t)*size);
     break;
   default:
     /* TODO: Shouldn't this be treated as a fatal error? */
@@ -1444,24 +3116,51 @@ static void x3f_load_image(x3f_info_t *I, x3f_directory_entry_t *DE)
   }
 }
 
+/* The key stream of type 2 comes from a linear congruential
+   generator, key = (key*CAMF_T2_MUL + CAMF_T2_ADD) % CAMF_T2_MOD, and
+   each byte is XORed with (key<<8)/CAMF_T2_MOD. The multiply-shift
+   expression originally used for that byte is the same division, for
+   all key < CAMF_T2_MOD.
+
+   To not wait for the previous key all the time, the stream is
+   generated in CAMF_T2_LANES interleaved lanes. Each lane jumps
+   CAMF_T2_LANES steps at a time, using the multiplier and increment
+   of that many steps. */
+
+#define CAMF_T2_MUL 1597
+#define CAMF_T2_ADD 51749
+#define CAMF_T2_MOD 244944
+#define CAMF_T2_LANES 8
+
 static void x3f_load_camf_decode_type2(x3f_camf_t *CAMF)
 {
   uint32_t key = CAMF->t2.crypt_key;
-  int i;
+  uint32_t lane[CAMF_T2_LANES];
+  uint64_t mul = 1, add = 0;
+  uint8_t *src = (uint8_t *)CAMF->data;
+  uint8_t *dst;
+  uint32_t i;
+  int j;
 
   CAMF->decoded_data_size = CAMF->data_size;
   CAMF->decoded_data = malloc(CAMF->decoded_data_size);
+  dst = (uint8_t *)CAMF->decoded_data;
 
-  for (i=0; i<CAMF->data_size; i++) {
-    uint8_t old, new;
-    uint32_t tmp;
-
-    old = ((uint8_t *)CAMF->data)[i];
-    key = (key * 1597 + 51749) % 244944;
-    tmp = (uint32_t)(key * ((int64_t)301593171) >> 24);
-    new = (uint8_t)(old ^ (uint8_t)(((((key << 8) - tmp) >> 1) + tmp) >> 17));
-    ((uint8_t *)CAMF->decoded_data)[i] = new;
+  for (j=0; j<CAMF_T2_LANES; j++) {
+    key = (key * CAMF_T2_MUL + CAMF_T2_ADD) % CAMF_T2_MOD;
+    lane[j] = key;
+    mul = (mul * CAMF_T2_MUL) % CAMF_T2_MOD;
+    add = (add * CAMF_T2_MUL + CAMF_T2_ADD) % CAMF_T2_MOD;
   }
+
+  for (i=0; i + CAMF_T2_LANES <= CAMF->data_size; i += CAMF_T2_LANES)
+    for (j=0; j<CAMF_T2_LANES; j++) {
+      dst[i+j] = src[i+j] ^ (uint8_t)((lane[j] << 8) / CAMF_T2_MOD);
+      lane[j] = (uint32_t)((mul * lane[j] + add) % CAMF_T2_MOD);
+    }
+
+  for (j=0; i<CAMF->data_size; i++, j++)
+    dst[i] = src[i] ^ (uint8_t)((lane[j] << 8) / CAMF_T2_MOD);
 }
 
 
@@ -1497,7 +3196,8 @@ static void camf_decode_type4(x3f_camf_t *CAMF)
   dst = (uint8_t *)CAMF->decoded_data;
   dst_end = dst + dst_size;
 
-  set_bit_state(&BS, CAMF->decoding_start);
+  set_bit_state(&BS, CAMF->decoding_start,
+		(uint8_t *)CAMF->data + CAMF->data_size);
 
   row_start_acc[0][0] = seed;
   row_start_acc[0][1] = seed;
@@ -1557,23 +3257,34 @@ static void camf_decode_type4(x3f_camf_t *CAMF)
  ready:;
 }
 
-static void x3f_load_camf_decode_type4(x3f_camf_t *CAMF)
+/* The Huffman table of types 4 and 5 is a list of (code_size, code)
+   byte pairs, ended by a zero code_size */
+
+static void get_camf_true_huffman_table(x3f_arena_t *A, x3f_camf_t *CAMF)
 {
-  int i;
-  uint8_t *p;
-  x3f_true_huffman_element_t *element = NULL;
+  uint8_t *p = CAMF->data;
+  uint8_t *end = p + CAMF->data_size;
+  x3f_true_huffman_element_t *element;
+  int i, num = 0;
+
+  while (p + 2*num + 1 < end && p[2*num] != 0)
+    num++;
 
-  for (i=0, p = CAMF->data; *p != 0; i++) {
-    /* TODO: Is this too expensive ??*/
-    element =
-      (x3f_true_huffman_element_t *)realloc(element, (i+1)*sizeof(*element));
+  element = (x3f_true_huffman_element_t *)
+    x3f_arena_alloc(A, num*sizeof(*element));
 
+  for (i=0; i<num; i++) {
     element[i].code_size = *p++;
     element[i].code = *p++;
   }
 
-  CAMF->table.size = i;
+  CAMF->table.size = num;
   CAMF->table.element = element;
+}
+
+static void x3f_load_camf_decode_type4(x3f_arena_t *A, x3f_camf_t *CAMF)
+{
+  get_camf_true_huffman_table(A, CAMF);
 
   /* TODO: where does the values 28 and 32 come from? */
 #define CAMF_T4_DATA_SIZE_OFFSET 28
@@ -1582,7 +3293,7 @@ static void x3f_load_camf_decode_type4(x3f_camf_t *CAMF)
   CAMF->decoding_start = (uint8_t *)CAMF->data + CAMF_T4_DATA_OFFSET;
 
   /* TODO: can it be fewer than 8 bits? Maybe taken from TRU->table? */
-  new_huffman_tree(&CAMF->tree, 8);
+  new_huffman_tree(A, &CAMF->tree, 8);
 
   populate_true_huffman_tree(&CAMF->tree, &CAMF->table);
 
@@ -1609,7 +3320,8 @@ static void camf_decode_type5(x3f_camf_t *CAMF)
 
   dst = (uint8_t *)CAMF->decoded_data;
 
-  set_bit_state(&BS, CAMF->decoding_start);
+  set_bit_state(&BS, CAMF->decoding_start,
+		(uint8_t *)CAMF->data + CAMF->data_size);
 
   for (i = 0; i < CAMF->decoded_data_size; i++) {
     int32_t diff = get_true_diff(&BS, tree);
@@ -1619,23 +3331,9 @@ static void camf_decode_type5(x3f_camf_t *CAMF)
   }
 }
 
-static void x3f_load_camf_decode_type5(x3f_camf_t *CAMF)
+static void x3f_load_camf_decode_type5(x3f_arena_t *A, x3f_camf_t *CAMF)
 {
-  int i;
-  uint8_t *p;
-  x3f_true_huffman_element_t *element = NULL;
-
-  for (i=0, p = CAMF->data; *p != 0; i++) {
-    /* TODO: Is this too expensive ??*/
-    element =
-      (x3f_true_huffman_element_t *)realloc(element, (i+1)*sizeof(*element));
-
-    element[i].code_size = *p++;
-    element[i].code = *p++;
-  }
-
-  CAMF->table.size = i;
-  CAMF->table.element = element;
+  get_camf_true_huffman_table(A, CAMF);
 
   /* TODO: where does the values 28 and 32 come from? */
 #define CAMF_T5_DATA_SIZE_OFFSET 28
@@ -1644,7 +3342,7 @@ static void x3f_load_camf_decode_type5(x3f_camf_t *CAMF)
   CAMF->decoding_start = (uint8_t *)CAMF->data + CAMF_T5_DATA_OFFSET;
 
   /* TODO: can it be fewer than 8 bits? Maybe taken from TRU->table? */
-  new_huffman_tree(&CAMF->tree, 8);
+  new_huffman_tree(A, &CAMF->tree, 8);
 
   populate_true_huffman_tree(&CAMF->tree, &CAMF->table);
 
@@ -1661,7 +3359,12 @@ static void x3f_setup_camf_text_entry(camf_entry_t *entry)
   entry->text = entry->value_address + 4;
 }
 
-static void x3f_setup_camf_property_entry(camf_entry_t *entry)
+static char *get_camf_property_name(void *table, uint32_t i)
+{
+  return ((char **)table)[i];
+}
+
+static void x3f_setup_camf_property_entry(x3f_arena_t *A, camf_entry_t *entry)
 {
   int i;
   uint8_t *e =
@@ -1672,8 +3375,8 @@ static void x3f_setup_camf_property_entry(camf_entry_t *entry)
     entry->property_num = *(uint32_t *)v;
   uint32_t off = *(uint32_t *)(v + 4);
 
-  entry->property_name = (char **)malloc(num*sizeof(uint8_t*));
-  entry->property_value = (uint8_t **)malloc(num*sizeof(uint8_t*));
+  entry->property_name = (char **)x3f_arena_alloc(A, num*sizeof(uint8_t*));
+  entry->property_value = (uint8_t **)x3f_arena_alloc(A, num*sizeof(uint8_t*));
 
   for (i=0; i<num; i++) {
     uint32_t name_off = off + *(uint32_t *)(v + 8 + 8*i);
@@ -1682,6 +3385,9 @@ static void x3f_setup_camf_property_entry(camf_entry_t *entry)
     entry->property_name[i] = (char *)(e + name_off);
     entry->property_value[i] = e + value_off;
   }
+
+  build_name_index(A, &entry->property_index, num,
+		   get_camf_property_name, entry->property_name);
 }
 
 static void set_matrix_element_info(uint32_t type,
@@ -1719,7 +3425,7 @@ static void set_matrix_element_info(uint32_t type,
   }
 }
 
-static void get_matrix_copy(camf_entry_t *entry)
+static void get_matrix_copy(x3f_arena_t *A, camf_entry_t *entry)
 {
   uint32_t element_size = entry->matrix_element_size;
   uint32_t elements = entry->matrix_elements;
@@ -1727,7 +3433,7 @@ static void get_matrix_copy(camf_entry_t *entry)
 		 sizeof(double) :
 		 sizeof(uint32_t)) * elements;
 
-  entry->matrix_decoded = malloc(size);
+  entry->matrix_decoded = x3f_arena_alloc(A, size);
 
   switch (element_size) {
   case 4:
@@ -1786,7 +3492,7 @@ static void get_matrix_copy(camf_entry_t *entry)
   }
 }
 
-static void x3f_setup_camf_matrix_entry(camf_entry_t *entry)
+static void x3f_setup_camf_matrix_entry(x3f_arena_t *A, camf_entry_t *entry)
 {
   int i;
   int totalsize = 1;
@@ -1803,7 +3509,7 @@ static void x3f_setup_camf_matrix_entry(camf_entry_t *entry)
     entry->matrix_data_off = *(uint32_t *)(v + 8);
   camf_dim_entry_t *dentry =
     entry->matrix_dim_entry =
-    (camf_dim_entry_t*)malloc(dim*sizeof(camf_dim_entry_t));
+    (camf_dim_entry_t*)x3f_arena_alloc(A, dim*sizeof(camf_dim_entry_t));
 
   for (i=0; i<dim; i++) {
     uint32_t size =
@@ -1834,19 +3540,35 @@ static void x3f_setup_camf_matrix_entry(camf_entry_t *entry)
   /* This estimate only works for matrices above a certain size */
   entry->matrix_estimated_element_size = entry->matrix_used_space / totalsize;
 
-  get_matrix_copy(entry);
+  /* The copy is made by x3f_get_camf_matrix_decoded, only for the
+     matrices actually used */
 }
 
-static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
+/* extern */ void *x3f_get_camf_matrix_decoded(x3f_t *x3f, camf_entry_t *entry)
 {
-  uint8_t *p = (uint8_t *)CAMF->decoded_data;
-  uint8_t *end = p + CAMF->decoded_data_size;
-  camf_entry_t *entry = NULL;
-  int i;
+  if (entry->matrix_decoded == NULL)
+    get_matrix_copy(&x3f->info.arena, entry);
+
+  return entry->matrix_decoded;
+}
+
+static char *get_camf_entry_name(void *table, uint32_t i)
+{
+  return ((camf_entry_t *)table)[i].name_address;
+}
+
+static void x3f_setup_camf_entries(x3f_arena_t *A, x3f_camf_t *CAMF)
+{
+  uint8_t *start = (uint8_t *)CAMF->decoded_data;
+  uint8_t *end = start + CAMF->decoded_data_size;
+  uint8_t *p;
+  camf_entry_t *entry;
+  int i, num;
 
   x3f_printf(DEBUG, "SETUP CAMF ENTRIES\n");
 
-  for (i=0; p < end; i++) {
+  /* Count the entries first, to allocate the table only once */
+  for (num=0, p=start; p < end; num++) {
     uint32_t *p4 = (uint32_t *)p;
 
     switch (*p4) {
@@ -1863,8 +3585,15 @@ static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
       goto stop;
     }
 
-    /* TODO: lots of realloc - may be inefficient */
-    entry = (camf_entry_t *)realloc(entry, (i+1)*sizeof(camf_entry_t));
+    p += p4[2];			/* entry_size */
+  }
+
+ stop:
+
+  entry = (camf_entry_t *)x3f_arena_alloc(A, num*sizeof(camf_entry_t));
+
+  for (i=0, p=start; i < num; i++) {
+    uint32_t *p4 = (uint32_t *)p;
 
     /* Pointer */
     entry[i].entry = p;
@@ -1887,6 +3616,8 @@ static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
     entry[i].property_num = 0;
     entry[i].property_name = NULL;
     entry[i].property_value = NULL;
+    entry[i].property_index.element = NULL;
+    entry[i].property_index.size = 0;
     entry[i].matrix_type = 0;
     entry[i].matrix_dim = 0;
     entry[i].matrix_data_off = 0;
@@ -1897,24 +3628,24 @@ static void x3f_setup_camf_entries(x3f_camf_t *CAMF)
 
     switch (entry[i].id) {
     case X3F_CMbP:
-      x3f_setup_camf_property_entry(&entry[i]);
+      x3f_setup_camf_property_entry(A, &entry[i]);
       break;
     case X3F_CMbT:
       x3f_setup_camf_text_entry(&entry[i]);
       break;
     case X3F_CMbM:
-      x3f_setup_camf_matrix_entry(&entry[i]);
+      x3f_setup_camf_matrix_entry(A, &entry[i]);
       break;
     }
 
     p += entry[i].entry_size;
   }
 
- stop:
-
   CAMF->entry_table.size = i;
   CAMF->entry_table.element = entry;
 
+  build_name_index(A, &CAMF->entry_index, i, get_camf_entry_name, entry);
+
   x3f_printf(DEBUG, "SETUP CAMF ENTRIES (READY) Found %d entries\n", i);
 }
 
@@ -1934,10 +3665,10 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
     x3f_load_camf_decode_type2(CAMF);
     break;
   case 4:			/* TRUE ... Merrill */
-    x3f_load_camf_decode_type4(CAMF);
+    x3f_load_camf_decode_type4(&I->arena, CAMF);
     break;
   case 5:			/* Quattro ... */
-    x3f_load_camf_decode_type5(CAMF);
+    x3f_load_camf_decode_type5(&I->arena, CAMF);
     break;
   default:
     /* TODO: Shouldn't this be treated as a fatal error? */
@@ -1945,12 +3676,73 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
   }
 
   if (CAMF->decoded_data != NULL)
-    x3f_setup_camf_entries(CAMF);
+    x3f_setup_camf_entries(&I->arena, CAMF);
   else
     /* TODO: Shouldn't this be treated as a fatal error? */
     x3f_printf(ERR, "No decoded CAMF data\n");
 }
 
+/* The sections that are close to each other are read together, as
+   for the section headers */
+
+/* extern */ x3f_return_t x3f_read_sections(x3f_t *x3f,
+					    x3f_directory_entry_t **DE, int num)
+{
+  x3f_info_t *I = &x3f->info;
+  x3f_directory_entry_t **sorted;
+  int n = 0, first, last, d;
+
+  if (num <= 0) return X3F_OK;
+
+  sorted = (x3f_directory_entry_t **)malloc(num*sizeof(*sorted));
+  if (sorted == NULL)
+    return X3F_INTERNAL_ERROR;
+
+  /* Sections not inside the file are left to be read when loaded */
+  for (d=0; d<num; d++)
+    if (DE[d] != NULL &&
+	DE[d]->input.offset <= I->input.size &&
+	I->input.size - DE[d]->input.offset >= DE[d]->input.size &&
+	find_chunk(I, DE[d]->input.offset, DE[d]->input.size) == NULL)
+      sorted[n++] = DE[d];
+  qsort(sorted, n, sizeof(*sorted), compare_entry_offset);
+
+  for (first = 0; first < n; first = last) {
+    uint32_t start = sorted[first]->input.offset;
+    uint64_t end = (uint64_t)start + sorted[first]->input.size;
+
+    for (last = first + 1; last < n; last++) {
+      uint64_t next = sorted[last]->input.offset;
+
+      if (next > end + X3F_COALESCE_GAP)
+	break;
+      if (next + sorted[last]->input.size > end)
+	end = next + sorted[last]->input.size;
+    }
+
+    if (read_chunk(I, start, end - start) == NULL) {
+      free(sorted);
+      return X3F_INTERNAL_ERROR;
+    }
+  }
+
+  free(sorted);
+
+  return X3F_OK;
+}
+
+/* Make sure that the whole section is in memory, where the loaders
+   find it */
+
+static x3f_return_t read_section(x3f_info_t *I, x3f_directory_entry_t *DE)
+{
+  if (find_chunk(I, DE->input.offset, DE->input.size) == NULL &&
+      read_chunk(I, DE->input.offset, DE->input.size) == NULL)
+    return X3F_INTERNAL_ERROR;
+
+  return X3F_OK;
+}
+
 /* extern */ x3f_return_t x3f_load_data(x3f_t *x3f, x3f_directory_entry_t *DE)
 {
   x3f_info_t *I = &x3f->info;
@@ -1960,12 +3752,15 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
 
   switch (DE->header.identifier) {
   case X3F_SECp:
+    if (read_section(I, DE) != X3F_OK)
+      return X3F_INTERNAL_ERROR;
     x3f_load_property_list(I, DE);
     break;
   case X3F_SECi:
-    x3f_load_image(I, DE);
-    break;
+    return x3f_load_image_region(x3f, DE, NULL);
   case X3F_SECc:
+    if (read_section(I, DE) != X3F_OK)
+      return X3F_INTERNAL_ERROR;
     x3f_load_camf(I, DE);
     break;
   default:
@@ -1976,6 +3771,50 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
   return X3F_OK;
 }
 
+/* extern */ x3f_return_t x3f_load_image_region(x3f_t *x3f,
+						 x3f_directory_entry_t *DE,
+						 uint32_t *rect)
+{
+  return x3f_load_image_planes(x3f, DE, rect, X3F_PLANES_ALL);
+}
+
+/* extern */ x3f_return_t x3f_load_image_planes(x3f_t *x3f,
+						 x3f_directory_entry_t *DE,
+						 uint32_t *rect, uint32_t planes)
+{
+  x3f_info_t *I = &x3f->info;
+  x3f_image_data_t *ID;
+
+  if (DE == NULL || DE->header.identifier != X3F_SECi ||
+      (planes & X3F_PLANES_ALL) == 0)
+    return X3F_ARGUMENT_ERROR;
+
+  ID = &DE->header.data_subsection.image_data;
+  ID->planes = planes & X3F_PLANES_ALL;
+
+  if (rect == NULL) {
+    ID->region[0] = ID->region[1] = 0;
+    ID->region[2] = ID->region[3] = UINT32_MAX; /* Clipped when loading */
+  } else {
+    if (rect[0] > rect[2] || rect[1] > rect[3])
+      return X3F_ARGUMENT_ERROR;
+    memcpy(ID->region, rect, sizeof(ID->region));
+    x3f_printf(DEBUG, "Load image region (%u,%u)-(%u,%u)\n",
+	       rect[0], rect[1], rect[2], rect[3]);
+  }
+
+  if (read_section(I, DE) != X3F_OK)
+    return X3F_INTERNAL_ERROR;
+
+  x3f_load_image(I, DE);
+
+  /* The region is empty after clipping if it was outside of the image */
+  if (ID->region[0] > ID->region[2] || ID->region[1] > ID->region[3])
+    return X3F_ARGUMENT_ERROR;
+
+  return X3F_OK;
+}
+
 /* extern */ x3f_return_t x3f_load_image_block(x3f_t *x3f, x3f_directory_entry_t *DE)
 {
   x3f_info_t *I = &x3f->info;
@@ -1987,6 +3826,8 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
 
   switch (DE->header.identifier) {
   case X3F_SECi:
+    if (read_section(I, DE) != X3F_OK)
+      return X3F_INTERNAL_ERROR;
     read_data_set_offset(I, DE, X3F_IMAGE_HEADER_SIZE);
     x3f_load_image_verbatim(I, DE);
     break;
@@ -1998,6 +3839,189 @@ static void x3f_load_camf(x3f_info_t *I, x3f_directory_entry_t *DE)
   return X3F_OK;
 }
 
+/* extern */ x3f_return_t x3f_collect_stats(x3f_t *x3f,
+					   x3f_directory_entry_t *DE,
+					   x3f_stats_setup_t setup, void *data)
+{
+  x3f_image_data_t *ID;
+
+  if (DE == NULL || DE->header.identifier != X3F_SECi || setup == NULL)
+    return X3F_ARGUMENT_ERROR;
+
+  ID = &DE->header.data_subsection.image_data;
+
+  if (ID->stats == NULL)
+    ID->stats = (x3f_image_stats_t *)
+      x3f_arena_alloc(&x3f->info.arena, sizeof(x3f_image_stats_t));
+
+  ID->stats->setup = setup;
+  ID->stats->data = data;
+  ID->stats->collected = 0;
+
+  return X3F_OK;
+}
+
+/* The index file is little endian uint32_t values: magic, version,
+   interval, then the unique identifier of the X3F file as bytes, and
+   then for each plane the plane size, the number of checkpoints and
+   the checkpoints. */
+
+#define X3F_TRUE_INDEX_MAGIC 0x49463358	/* "X3FI" */
+#define X3F_TRUE_INDEX_VERSION 2
+
+/* extern */ x3f_return_t x3f_load_true_index(x3f_t *x3f,
+					      x3f_directory_entry_t *DE,
+					      char *filename)
+{
+  x3f_image_data_t *ID;
+  x3f_true_index_t *TI;
+  FILE *f;
+  long size;
+  uint8_t *buf, *p, *end;
+  uint32_t magic, version, interval;
+  int i;
+
+  if (DE == NULL || DE->header.identifier != X3F_SECi)
+    return X3F_ARGUMENT_ERROR;
+
+  ID = &DE->header.data_subsection.image_data;
+
+  if (NULL == (f = fopen(filename, "rb")))
+    return X3F_INFILE_ERROR;
+
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  if (size < 3*4 + SIZE_UNIQUE_IDENTIFIER) {
+    fclose(f);
+    return X3F_INFILE_ERROR;
+  }
+
+  if (NULL == (buf = (uint8_t *)malloc(size))) {
+    fclose(f);
+    return X3F_INTERNAL_ERROR;
+  }
+
+  if (fread(buf, 1, size, f) != size) {
+    free(buf);
+    fclose(f);
+    return X3F_INFILE_ERROR;
+  }
+  fclose(f);
+
+  p = buf;
+  end = buf + size;
+
+  MGET4(p, magic);
+  MGET4(p, version);
+  MGET4(p, interval);
+
+  if (magic != X3F_TRUE_INDEX_MAGIC || version != X3F_TRUE_INDEX_VERSION ||
+      interval == 0) {
+    x3f_printf(WARN, "Unknown TRUE index file %s\n", filename);
+    free(buf);
+    return X3F_INFILE_ERROR;
+  }
+
+  if (memcmp(p, x3f->header.unique_identifier, SIZE_UNIQUE_IDENTIFIER)) {
+    x3f_printf(WARN, "TRUE index file %s is for another file\n", filename);
+    free(buf);
+    return X3F_INFILE_ERROR;
+  }
+  p += SIZE_UNIQUE_IDENTIFIER;
+
+  TI = new_true_index(&ID->true_index, interval);
+
+  for (i=0; i<TRUE_PLANES; i++) {
+    x3f_true_checkpoint_table_t *table = &TI->checkpoint[i];
+    uint32_t num, j;
+
+    if (end - p < 2*4) break;
+    MGET4(p, TI->plane_size[i]);
+    MGET4(p, num);
+    if ((end - p)/(5*4) < num) break;
+
+    table->element =
+      (x3f_true_checkpoint_t *)malloc(num*sizeof(x3f_true_checkpoint_t));
+    if (num > 0 && table->element == NULL) break;
+    table->size = num;
+
+    for (j=0; j<num; j++) {
+      x3f_true_checkpoint_t *C = &table->element[j];
+
+      MGET4(p, C->bit_offset);
+      MGET4(p, C->row_start_acc[0][0]);
+      MGET4(p, C->row_start_acc[0][1]);
+      MGET4(p, C->row_start_acc[1][0]);
+      MGET4(p, C->row_start_acc[1][1]);
+    }
+  }
+
+  free(buf);
+
+  if (i < TRUE_PLANES) {
+    x3f_printf(WARN, "Truncated TRUE index file %s\n", filename);
+    cleanup_true_index(&ID->true_index);
+    return X3F_INFILE_ERROR;
+  }
+
+  return X3F_OK;
+}
+
+/* extern */ x3f_return_t x3f_save_true_index(x3f_t *x3f,
+					      x3f_directory_entry_t *DE,
+					      char *filename)
+{
+  x3f_true_index_t *TI;
+  FILE *f;
+  int i;
+
+  if (DE == NULL || DE->header.identifier != X3F_SECi)
+    return X3F_ARGUMENT_ERROR;
+
+  TI = DE->header.data_subsection.image_data.true_index;
+
+  if (TI == NULL)
+    return X3F_ARGUMENT_ERROR;
+
+  if (NULL == (f = fopen(filename, "wb")))
+    return X3F_OUTFILE_ERROR;
+
+  x3f_put4(f, X3F_TRUE_INDEX_MAGIC);
+  x3f_put4(f, X3F_TRUE_INDEX_VERSION);
+  x3f_put4(f, TI->interval);
+  fwrite(x3f->header.unique_identifier, 1, SIZE_UNIQUE_IDENTIFIER, f);
+
+  for (i=0; i<TRUE_PLANES; i++) {
+    x3f_true_checkpoint_table_t *table = &TI->checkpoint[i];
+    uint32_t j;
+
+    x3f_put4(f, TI->plane_size[i]);
+    x3f_put4(f, table->size);
+
+    for (j=0; j<table->size; j++) {
+      x3f_true_checkpoint_t *C = &table->element[j];
+
+      x3f_put4(f, C->bit_offset);
+      x3f_put4(f, C->row_start_acc[0][0]);
+      x3f_put4(f, C->row_start_acc[0][1]);
+      x3f_put4(f, C->row_start_acc[1][0]);
+      x3f_put4(f, C->row_start_acc[1][1]);
+    }
+  }
+
+  if (ferror(f)) {
+    fclose(f);
+    return X3F_OUTFILE_ERROR;
+  }
+
+  if (fclose(f) != 0)
+    return X3F_OUTFILE_ERROR;
+
+  return X3F_OK;
+}
+
 /* extern */ char *x3f_err(x3f_return_t err)
 {
   switch (err) {
@@ -18,6 +18,8 @@
 #ifndef X3F_IO_H
 #define X3F_IO_H
 
+#include "x3f_arena.h"
+
 #include <inttypes.h>
 #include <stdio.h>
 
@@ -126,6 +128,19 @@ typedef struct x3f_property_table_s {
   x3f_property_t *element;
 } x3f_property_table_t;
 
+/* Hash index from a name to its position in a table. Open addressing,
+   the size is a power of two. If a name occurs more than once, the
+   first position is found, as when searching the table. */
+typedef struct x3f_name_index_entry_s {
+  char *name;			/* NULL for an empty slot */
+  uint32_t position;
+} x3f_name_index_entry_t;
+
+typedef struct x3f_name_index_s {
+  uint32_t size;
+  x3f_name_index_entry_t *element;
+} x3f_name_index_t;
+
 typedef struct x3f_property_list_s {
   /* 2.0 Fields */
   uint32_t num_properties;
@@ -134,6 +149,7 @@ typedef struct x3f_property_list_s {
   uint32_t total_length;
 
   x3f_property_table_t property_table;
+  x3f_name_index_t property_index;
 
   void *data;
 
@@ -174,8 +190,21 @@ typedef struct
   uint32_t columns;
   uint32_t channels;
   uint32_t row_stride;
+  uint32_t plane_stride;	/* 0 if interleaved, else the distance
+				   between the planes of a planar area */
 } x3f_area16_t;
 
+/* The distance between two pixels, and between two channels of a
+   pixel, in an area. In a planar area each channel is a plane of its
+   own, with the pixels of a row next to each other. */
+#define X3F_PIXEL_STRIDE(A) ((A)->plane_stride ? 1 : (A)->channels)
+#define X3F_CHANNEL_STRIDE(A) ((A)->plane_stride ? (A)->plane_stride : 1)
+
+#define X3F_AREA_PIXEL(A, ROW, COL, COLOR)		\
+  ((A)->data[(A)->row_stride*(ROW) +			\
+	     X3F_PIXEL_STRIDE(A)*(COL) +		\
+	     X3F_CHANNEL_STRIDE(A)*(COLOR)])
+
 #define UNDEFINED_LEAF 0xffffffff
 
 typedef struct x3f_huffnode_s {
@@ -183,9 +212,16 @@ typedef struct x3f_huffnode_s {
   uint32_t leaf;
 } x3f_huffnode_t;
 
+typedef struct x3f_hufflut_s {
+  int32_t value;	    /* Leaf value, or complete TRUE difference */
+  uint8_t length;	    /* Bits consumed. 0 means walk the tree */
+  uint8_t diff_bits;	    /* TRUE difference bits still to be read */
+} x3f_hufflut_t;
+
 typedef struct x3f_hufftree_s {
   uint32_t free_node_index; /* Free node index in huffman tree array */
   x3f_huffnode_t *nodes;    /* Coding tree */
+  x3f_hufflut_t *lut;	    /* Lookup table indexed by the next bits */
 } x3f_hufftree_t;
 
 typedef struct x3f_true_huffman_element_s {
@@ -201,6 +237,10 @@ typedef struct x3f_true_huffman_s {
 /* 0=bottom, 1=middle, 2=top */
 #define TRUE_PLANES 3
 
+/* Masks of TRUE planes, see x3f_load_image_planes */
+#define X3F_PLANE(P) (1<<(P))
+#define X3F_PLANES_ALL (X3F_PLANE(0) | X3F_PLANE(1) | X3F_PLANE(2))
+
 typedef struct x3f_true_s {
   uint16_t seed[TRUE_PLANES];	/* Always 512,512,512 */
   uint16_t unknown;		/* Always 0 */
@@ -214,6 +254,25 @@ typedef struct x3f_true_s {
   x3f_area16_t x3rgb16;		/* 3x16 bit X3-RGB data */
 } x3f_true_t;
 
+typedef struct x3f_true_checkpoint_s {
+  uint32_t bit_offset;		/* From the start of the plane */
+  int32_t row_start_acc[2][2];	/* Decoder state at the start of the row */
+} x3f_true_checkpoint_t;
+
+typedef struct x3f_true_checkpoint_table_s {
+  uint32_t size;
+  x3f_true_checkpoint_t *element;
+} x3f_true_checkpoint_table_t;
+
+/* The TRUE planes are sequential streams. The index holds the decoder
+   state for every interval rows, so that decoding can start at any of
+   those rows. It is recorded while decoding. */
+typedef struct x3f_true_index_s {
+  uint32_t interval;		/* Rows between the checkpoints */
+  uint32_t plane_size[TRUE_PLANES]; /* The planes it was recorded for */
+  x3f_true_checkpoint_table_t checkpoint[TRUE_PLANES];
+} x3f_true_index_t;
+
 typedef struct x3f_quattro_s {
   struct {
     uint16_t columns;
@@ -234,6 +293,47 @@ typedef struct x3f_huffman_s {
   x3f_area16_t x3rgb16;		/* 3x16 bit X3-RGB data */
 } x3f_huffman_t;
 
+/* Statistics collected while decoding TRUE RAW data, so that the
+   areas need not be read again afterwards. See x3f_collect_stats. */
+
+#define X3F_STATS_MAX_RECTS 4
+#define X3F_STATS_HIST_SHIFT 8	/* Values per bin, as a power of 2 */
+#define X3F_STATS_HIST_SIZE (1<<(16-X3F_STATS_HIST_SHIFT))
+
+typedef struct x3f_rect_stats_s {
+  uint32_t rect[4];		/* Columns and rows, from and to,
+				   including. Set by the setup. */
+  uint32_t pixels;
+  uint64_t sum[3];		/* Per channel */
+  uint64_t sum_sq[3];
+  uint16_t min[3];
+  uint16_t max[3];
+} x3f_rect_stats_t;
+
+typedef struct x3f_area_stats_s {
+  uint32_t num_rects;		/* Set by the setup */
+  x3f_rect_stats_t rect[X3F_STATS_MAX_RECTS];
+  bool_t histogram;		/* Set by the setup, if wanted */
+  uint32_t bin[3][X3F_STATS_HIST_SIZE];
+} x3f_area_stats_t;
+
+typedef struct x3f_image_stats_s x3f_image_stats_t;
+
+/* Called when the areas are allocated, but not yet decoded, to set
+   the rects of the statistics in the coordinates of the areas. top16
+   is NULL if not used. Returns 0 if no statistics are wanted. */
+typedef int (*x3f_stats_setup_t)(void *data, x3f_image_stats_t *S,
+				 x3f_area16_t *x3rgb16, x3f_area16_t *top16);
+
+struct x3f_image_stats_s {
+  x3f_stats_setup_t setup;
+  void *data;			/* Given to setup */
+  bool_t collected;		/* Set when decoded. Cleared by anyone
+				   changing the decoded data. */
+  x3f_area_stats_t x3rgb16;	/* Of TRU->x3rgb16 */
+  x3f_area_stats_t top16;	/* Of Q->top16, channel 0 only */
+};
+
 typedef struct x3f_image_data_s {
   /* 2.0 Fields */
   /* ------------------------------------------------------------------ */
@@ -257,12 +357,21 @@ typedef struct x3f_image_data_s {
   x3f_huffman_t *huffman;       /* Huffman help data */
   x3f_true_t *tru;		/* TRUE help data */
   x3f_quattro_t *quattro;	/* Quattro help data */
+  x3f_true_index_t *true_index;	/* TRUE checkpoint index */
+  x3f_image_stats_t *stats;	/* Statistics to collect */
 
   void *data;                   /* Take from file if NULL. Otherwise,
                                    this is the actual data bytes in
                                    the file. */
   uint32_t data_size;
 
+  /* The part of the image that is decoded, as columns and rows, from
+     and to, including. See x3f_load_image_region. */
+  uint32_t region[4];
+
+  /* The TRUE planes that are decoded. See x3f_load_image_planes. */
+  uint32_t planes;
+
 } x3f_image_data_t;
 
 typedef struct camf_dim_entry_s {
@@ -298,6 +407,7 @@ typedef struct camf_entry_s {
   uint32_t property_num;
   char **property_name;
   uint8_t **property_value;
+  x3f_name_index_t property_index;
 
   uint32_t matrix_dim;
   camf_dim_entry_t *matrix_dim_entry;
@@ -308,7 +418,8 @@ typedef struct camf_entry_s {
   void *matrix_data;
   uint32_t matrix_element_size;
 
-  /* Pointer and type of copied data */
+  /* Pointer and type of copied data. NULL until the matrix is first
+     asked for, see x3f_get_camf_matrix_decoded */
   matrix_type_t matrix_decoded_type;
   void *matrix_decoded;
 
@@ -379,6 +490,7 @@ typedef struct x3f_camf_s {
 
   /* Pointers into the decrypted data */
   camf_entry_table_t entry_table;
+  x3f_name_index_t entry_index;
 } x3f_camf_t;
 
 typedef struct x3f_directory_entry_header_s {
@@ -429,11 +541,103 @@ typedef struct x3f_header_s {
   float extended_data[NUM_EXT_DATA]; /* 32 bits, but do type differ? */
 } x3f_header_t;
 
+/* Input that is read in ranges. Reads may be slow, so they are
+   merged into as few as possible. */
+typedef struct x3f_io_s {
+  void *handle;
+  /* Read size bytes at offset into buf. Returns the number of bytes
+     read, which is less than size only at the end of the input. */
+  uint32_t (*read_at)(void *handle, uint32_t offset, uint32_t size,
+		      void *buf);
+  uint32_t (*size)(void *handle);
+} x3f_io_t;
+
+/* A part of the input that has been read into memory */
+typedef struct x3f_chunk_s {
+  uint32_t offset;
+  uint32_t size;
+  uint8_t *data;
+} x3f_chunk_t;
+
+typedef struct x3f_chunk_table_s {
+  uint32_t size;
+  x3f_chunk_t *element;
+} x3f_chunk_table_t;
+
+#define X3F_PROBE_MAX_SECTIONS 16
+
+typedef struct x3f_probe_section_s {
+  uint32_t type;		/* The identifier, e.g. X3F_SECi */
+  uint32_t size;
+  uint32_t type_format;		/* Images only, else 0 */
+  uint32_t columns;
+  uint32_t rows;
+} x3f_probe_section_t;
+
+/* What x3f_probe finds in the header and the directory. The header
+   fields are 0 (empty) for version 4.0 and later, where their meaning
+   is unknown. */
+typedef struct x3f_probe_s {
+  uint32_t version;
+  uint32_t columns;
+  uint32_t rows;
+  uint32_t rotation;
+  char white_balance[SIZE_WHITE_BALANCE+1];
+  uint32_t raw_type_format;	/* Of x3f_get_raw, or 0 if none */
+  uint32_t raw_columns;
+  uint32_t raw_rows;
+  uint32_t num_sections;	/* All of them, also if more than fit */
+  x3f_probe_section_t section[X3F_PROBE_MAX_SECTIONS];
+} x3f_probe_t;
+
+/* A buffer kept by a decoder for reuse */
+typedef struct x3f_buffer_s {
+  void *data;
+  size_t size;
+} x3f_buffer_t;
+
+#define X3F_DECODER_BUFFERS 8
+
+/* A decoder keeps the image and section buffers, and the tables and
+   Huffman trees, of the x3f that uses it when that is deleted. The
+   next x3f using the decoder gets them again, instead of allocating
+   new ones. In batch runs the same sizes mostly repeat from file to
+   file.
+
+   If the caller sets image.data, with columns, rows, channels (3),
+   row_stride and plane_stride, TRUE RAW data is decoded right into
+   that memory, if it is big enough. The x3rgb16 area then does not
+   own the memory (buf is NULL), and it is not freed or kept by the
+   decoder. Nothing else writes to that memory. If planar data needs
+   to be interleaved, e.g. by x3f_get_image for denoising, that is
+   done into a new buffer owned by x3rgb16. Other images are decoded
+   into buffers as usual. */
+typedef struct x3f_decoder_s {
+  x3f_area16_t image;		/* The caller's memory, or data NULL */
+  x3f_buffer_t buffer[X3F_DECODER_BUFFERS];
+  x3f_arena_t arena;		/* Only spare blocks */
+} x3f_decoder_t;
+
 typedef struct x3f_info_s {
   char *error;
   struct {
-    FILE *file;                 /* Use if more data is needed */
-  } input, output;
+    FILE *file;                 /* The input file, or NULL */
+    x3f_io_t io;		/* Reads the input, if not in memory */
+    uint32_t size;		/* Size of the input */
+    uint32_t offset;		/* Where the next data is read */
+    x3f_chunk_t section;	/* The section being read */
+  } input;
+  struct {
+    FILE *file;
+  } output;
+  struct {
+    uint8_t *data;		/* The input file mapped into memory, */
+    uint32_t size;		/* the caller's memory, or NULL */
+  } map;
+  x3f_chunk_table_t chunks;	/* Parts of the input read so far */
+  x3f_arena_t arena;		/* Tables and help data, freed by
+				   x3f_delete. Not the image buffers. */
+  x3f_decoder_t *decoder;	/* Or NULL */
 } x3f_info_t;
 
 typedef struct x3f_s {
@@ -452,11 +656,36 @@ typedef enum x3f_return_e {
 
 extern int legacy_offset;
 extern bool_t auto_legacy_offset;
+extern bool_t use_mmap;
+extern uint32_t true_checkpoint_interval;
+extern bool_t true_planar;
 
 extern x3f_t *x3f_new_from_file(FILE *infile);
 
+/* The data must be kept until x3f_delete, as the sections point into
+   it */
+extern x3f_t *x3f_new_from_memory(const uint8_t *data, size_t size);
+
+/* The io is copied, but its handle must be valid until x3f_delete */
+extern x3f_t *x3f_new_from_io(x3f_io_t *io);
+
 extern x3f_return_t x3f_delete(x3f_t *x3f);
 
+/* Read only the header, the directory and the section headers of a
+   file, without mapping it or reading any section data. The camera ID
+   is only found in CAMF, and is therefore not probed. */
+extern x3f_return_t x3f_probe(FILE *infile, x3f_probe_t *P);
+
+extern x3f_decoder_t *x3f_new_decoder(void);
+
+/* All x3f using the decoder must have been deleted */
+extern void x3f_delete_decoder(x3f_decoder_t *D);
+
+/* Let x3f allocate its buffers and help data from D, and give them
+   back to it at x3f_delete. Call it before loading any data. A
+   decoder can be used by only one x3f at a time. */
+extern void x3f_use_decoder(x3f_t *x3f, x3f_decoder_t *D);
+
 extern x3f_directory_entry_t *x3f_get_raw(x3f_t *x3f);
 
 extern x3f_directory_entry_t *x3f_get_thumb_plain(x3f_t *x3f);
@@ -469,10 +698,71 @@ extern x3f_directory_entry_t *x3f_get_camf(x3f_t *x3f);
 
 extern x3f_directory_entry_t *x3f_get_prop(x3f_t *x3f);
 
+/* The position of name in the table of the index, or -1 if not
+   found */
+extern int x3f_find_name(x3f_name_index_t *NI, const char *name);
+
+/* The matrix of a CAMF matrix entry, converted to matrix_decoded_type.
+   It is converted on the first call and then kept. */
+extern void *x3f_get_camf_matrix_decoded(x3f_t *x3f, camf_entry_t *entry);
+
+/* Write size bytes of the input, from offset, to outfile. The bytes
+   are copied by the kernel if possible, and then never pass through
+   memory or any of the structures of x3f. Bytes beyond the end of the
+   input are written as 0. */
+extern x3f_return_t x3f_copy_input(x3f_t *x3f, uint32_t offset,
+				   uint32_t size, FILE *outfile);
+
+/* Read the data of the sections that are going to be loaded, with as
+   few reads as possible. Otherwise each x3f_load_data reads its own
+   section. NULL entries are ignored. */
+extern x3f_return_t x3f_read_sections(x3f_t *x3f,
+				      x3f_directory_entry_t **DE, int num);
+
 extern x3f_return_t x3f_load_data(x3f_t *x3f, x3f_directory_entry_t *DE);
 
+/* Decode only the part rect (columns and rows, from and to, including)
+   of a RAW image or Huffman thumbnail. The rect is in the coordinates
+   of x3rgb16 (rgb8 for thumbnails) and is clipped to the image. The
+   decoded areas then only cover that part. NULL means the whole
+   image, as for x3f_load_data. The automatic legacy offset is always
+   that of the whole image, so that decoded parts match. For a part,
+   that costs an extra entropy pass over the whole image. */
+extern x3f_return_t x3f_load_image_region(x3f_t *x3f,
+					  x3f_directory_entry_t *DE,
+					  uint32_t *rect);
+
+/* As x3f_load_image_region, but only decode the TRUE planes in the
+   mask planes, e.g. X3F_PLANE(2) for the Quattro top layer. The
+   channels of x3rgb16 of the other planes are undefined. If none of
+   its planes are decoded, x3rgb16 (or Q->top16) is not allocated at
+   all. Statistics are only collected if all planes are decoded. For
+   other image types, planes is ignored. */
+extern x3f_return_t x3f_load_image_planes(x3f_t *x3f,
+					  x3f_directory_entry_t *DE,
+					  uint32_t *rect, uint32_t planes);
+
 extern x3f_return_t x3f_load_image_block(x3f_t *x3f, x3f_directory_entry_t *DE);
 
+/* Collect statistics of the areas set up by setup, while the next
+   x3f_load_data or x3f_load_image_region decodes TRUE RAW data. They
+   are then found in ID->stats, if collected is set. Other image types
+   are not supported. */
+extern x3f_return_t x3f_collect_stats(x3f_t *x3f, x3f_directory_entry_t *DE,
+				      x3f_stats_setup_t setup, void *data);
+
+/* Read and write the TRUE checkpoint index of an image, so that it
+   can be reused for later decodes of the same file. A read index is
+   used by the next x3f_load_data or x3f_load_image_region if it
+   matches the data. */
+extern x3f_return_t x3f_load_true_index(x3f_t *x3f,
+					x3f_directory_entry_t *DE,
+					char *filename);
+
+extern x3f_return_t x3f_save_true_index(x3f_t *x3f,
+					x3f_directory_entry_t *DE,
+					char *filename);
+
 extern char *x3f_err(x3f_return_t err);
 
 #ifdef __cplusplus
@@ -14,40 +14,41 @@
 #include <stdio.h>
 #include <string.h>
 
-/* extern */ int x3f_get_camf_text(x3f_t *x3f, char *name, char **text)
+/* The CAMF entry called name, or NULL */
+static camf_entry_t *find_camf_entry(x3f_t *x3f, char *name)
 {
   x3f_directory_entry_t *DE = x3f_get_camf(x3f);
-  x3f_directory_entry_header_t *DEH;
   x3f_camf_t *CAMF;
-  camf_entry_t *table;
   int i;
 
   if (!DE) {
     x3f_printf(DEBUG, "Could not get entry %s: CAMF section not found\n", name);
-    return 0;
+    return NULL;
   }
 
-  DEH = &DE->header;
-  CAMF = &DEH->data_subsection.camf;
-  table = CAMF->entry_table.element;
+  CAMF = &DE->header.data_subsection.camf;
+  i = x3f_find_name(&CAMF->entry_index, name);
+  if (i < 0) {
+    x3f_printf(DEBUG, "CAMF entry not found: %s\n", name);
+    return NULL;
+  }
+
+  return &CAMF->entry_table.element[i];
+}
 
-  for (i=0; i<CAMF->entry_table.size; i++) {
-    camf_entry_t *entry = &table[i];
+/* extern */ int x3f_get_camf_text(x3f_t *x3f, char *name, char **text)
+{
+  camf_entry_t *entry = find_camf_entry(x3f, name);
 
-    if (!strcmp(name, entry->name_address)) {
-      if (entry->id != X3F_CMbT) {
-	x3f_printf(DEBUG, "CAMF entry is not text: %s\n", name);
-	return 0;
-      }
+  if (!entry) return 0;
 
-      *text = entry->text;
-      return 1;
-    }
+  if (entry->id != X3F_CMbT) {
+    x3f_printf(DEBUG, "CAMF entry is not text: %s\n", name);
+    return 0;
   }
 
-  x3f_printf(DEBUG, "CAMF entry not found: %s\n", name);
-
-  return 0;
+  *text = entry->text;
+  return 1;
 }
 
 /* extern */ int x3f_get_camf_matrix_var(x3f_t *x3f, char *name,
@@ -55,73 +56,52 @@
 					 matrix_type_t type,
 					 void **matrix)
 {
-  x3f_directory_entry_t *DE = x3f_get_camf(x3f);
-  x3f_directory_entry_header_t *DEH;
-  x3f_camf_t *CAMF;
-  camf_entry_t *table;
-  int i;
+  camf_entry_t *entry = find_camf_entry(x3f, name);
 
-  if (!DE) {
-    x3f_printf(DEBUG, "Could not get entry %s: CAMF section not found\n", name);
+  if (!entry) return 0;
+
+  if (entry->id != X3F_CMbM) {
+    x3f_printf(DEBUG, "CAMF entry is not a matrix: %s\n", name);
+    return 0;
+  }
+  if (entry->matrix_decoded_type != type) {
+    x3f_printf(DEBUG, "CAMF entry not required type: %s\n", name);
     return 0;
   }
 
-  DEH = &DE->header;
-  CAMF = &DEH->data_subsection.camf;
-  table = CAMF->entry_table.element;
-
-  for (i=0; i<CAMF->entry_table.size; i++) {
-    camf_entry_t *entry = &table[i];
-
-    if (!strcmp(name, entry->name_address)) {
-      if (entry->id != X3F_CMbM) {
-	x3f_printf(DEBUG, "CAMF entry is not a matrix: %s\n", name);
-	return 0;
-      }
-      if (entry->matrix_decoded_type != type) {
-	x3f_printf(DEBUG, "CAMF entry not required type: %s\n", name);
-	return 0;
-      }
-
-      switch (entry->matrix_dim) {
-      case 3:
-	if (dim2 == NULL || dim1 == NULL || dim0 == NULL) {
-	  x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
-	  return 0;
-	}
-	*dim2 = entry->matrix_dim_entry[2].size;
-	*dim1 = entry->matrix_dim_entry[1].size;
-	*dim0 = entry->matrix_dim_entry[0].size;
-      break;
-      case 2:
-	if (dim2 != NULL || dim1 == NULL || dim0 == NULL) {
-	  x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
-	  return 0;
-	}
-	*dim1 = entry->matrix_dim_entry[1].size;
-	*dim0 = entry->matrix_dim_entry[0].size;
-      break;
-      case 1:
-	if (dim2 != NULL || dim1 != NULL || dim0 == NULL) {
-	  x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
-	  return 0;
-	}
-	*dim0 = entry->matrix_dim_entry[0].size;
-	break;
-      default:
-	x3f_printf(DEBUG, "CAMF entry - more than 3 dimensions: %s\n", name);
-	return 0;
-      }
-
-      x3f_printf(DEBUG, "Getting CAMF matrix for %s\n", name);
-      *matrix = entry->matrix_decoded;
-      return 1;
+  switch (entry->matrix_dim) {
+  case 3:
+    if (dim2 == NULL || dim1 == NULL || dim0 == NULL) {
+      x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
+      return 0;
+    }
+    *dim2 = entry->matrix_dim_entry[2].size;
+    *dim1 = entry->matrix_dim_entry[1].size;
+    *dim0 = entry->matrix_dim_entry[0].size;
+  break;
+  case 2:
+    if (dim2 != NULL || dim1 == NULL || dim0 == NULL) {
+      x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
+      return 0;
+    }
+    *dim1 = entry->matrix_dim_entry[1].size;
+    *dim0 = entry->matrix_dim_entry[0].size;
+  break;
+  case 1:
+    if (dim2 != NULL || dim1 != NULL || dim0 == NULL) {
+      x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
+      return 0;
     }
+    *dim0 = entry->matrix_dim_entry[0].size;
+    break;
+  default:
+    x3f_printf(DEBUG, "CAMF entry - more than 3 dimensions: %s\n", name);
+    return 0;
   }
 
-  x3f_printf(DEBUG, "CAMF entry not found: %s\n", name);
-
-  return 0;
+  x3f_printf(DEBUG, "Getting CAMF matrix for %s\n", name);
+  *matrix = x3f_get_camf_matrix_decoded(x3f, entry);
+  return 1;
 }
 
 /* extern */ int x3f_get_camf_matrix(x3f_t *x3f, char *name,
@@ -129,78 +109,56 @@
 				     matrix_type_t type,
 				     void *matrix)
 {
-  x3f_directory_entry_t *DE = x3f_get_camf(x3f);
-  x3f_directory_entry_header_t *DEH;
-  x3f_camf_t *CAMF;
-  camf_entry_t *table;
-  int i;
+  camf_entry_t *entry = find_camf_entry(x3f, name);
+  int size;
 
-  if (!DE) {
-    x3f_printf(DEBUG, "Could not get entry %s: CAMF section not found\n", name);
+  if (!entry) return 0;
+
+  if (entry->id != X3F_CMbM) {
+    x3f_printf(DEBUG, "CAMF entry is not a matrix: %s\n", name);
+    return 0;
+  }
+  if (entry->matrix_decoded_type != type) {
+    x3f_printf(DEBUG, "CAMF entry not required type: %s\n", name);
     return 0;
   }
 
-  DEH = &DE->header;
-  CAMF = &DEH->data_subsection.camf;
-  table = CAMF->entry_table.element;
-
-  for (i=0; i<CAMF->entry_table.size; i++) {
-    camf_entry_t *entry = &table[i];
-
-    if (!strcmp(name, entry->name_address)) {
-      int size;
-
-      if (entry->id != X3F_CMbM) {
-	x3f_printf(DEBUG, "CAMF entry is not a matrix: %s\n", name);
-	return 0;
-      }
-      if (entry->matrix_decoded_type != type) {
-	x3f_printf(DEBUG, "CAMF entry not required type: %s\n", name);
-	return 0;
-      }
-
-      switch (entry->matrix_dim) {
-      case 3:
-	if (dim2 != entry->matrix_dim_entry[2].size ||
-	    dim1 != entry->matrix_dim_entry[1].size ||
-	    dim0 != entry->matrix_dim_entry[0].size) {
-	  x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
-	  return 0;
-	}
-	break;
-      case 2:
-	if (dim2 != 0 ||
-	    dim1 != entry->matrix_dim_entry[1].size ||
-	    dim0 != entry->matrix_dim_entry[0].size) {
-	  x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
-	  return 0;
-	}
-	break;
-      case 1:
-	if (dim2 != 0 ||
-	    dim1 != 0 ||
-	    dim0 != entry->matrix_dim_entry[0].size) {
-	  x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
-	  return 0;
-	}
-	break;
-      default:
-	x3f_printf(DEBUG, "CAMF entry - more than 3 dimensions: %s\n", name);
-	return 0;
-      }
-
-      size = (entry->matrix_decoded_type==M_FLOAT ?
-	      sizeof(double) :
-	      sizeof(uint32_t)) * entry->matrix_elements;
-      x3f_printf(DEBUG, "Copying CAMF matrix for %s\n", name);
-      memcpy(matrix, entry->matrix_decoded, size);
-      return 1;
+  switch (entry->matrix_dim) {
+  case 3:
+    if (dim2 != entry->matrix_dim_entry[2].size ||
+	dim1 != entry->matrix_dim_entry[1].size ||
+	dim0 != entry->matrix_dim_entry[0].size) {
+      x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
+      return 0;
     }
+    break;
+  case 2:
+    if (dim2 != 0 ||
+	dim1 != entry->matrix_dim_entry[1].size ||
+	dim0 != entry->matrix_dim_entry[0].size) {
+      x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
+      return 0;
+    }
+    break;
+  case 1:
+    if (dim2 != 0 ||
+	dim1 != 0 ||
+	dim0 != entry->matrix_dim_entry[0].size) {
+      x3f_printf(DEBUG, "CAMF entry - wrong dimension size: %s\n", name);
+      return 0;
+    }
+    break;
+  default:
+    x3f_printf(DEBUG, "CAMF entry - more than 3 dimensions: %s\n", name);
+    return 0;
   }
 
-  x3f_printf(DEBUG, "CAMF entry not found: %s\n", name);
-
-  return 0;
+  size = (entry->matrix_decoded_type==M_FLOAT ?
+	  sizeof(double) :
+	  sizeof(uint32_t)) * entry->matrix_elements;
+  x3f_printf(DEBUG, "Copying CAMF matrix for %s\n", name);
+  memcpy(matrix, x3f_get_camf_matrix_decoded(x3f, entry), size);
+  return 1;
 }
 
 /* extern */ int x3f_get_camf_float(x3f_t *x3f, char *name,  double *val)
@@ -233,62 +191,44 @@
 					    char ***names, char ***values,
 					    uint32_t *num)
 {
-  x3f_directory_entry_t *DE = x3f_get_camf(x3f);
-  x3f_directory_entry_header_t *DEH;
-  x3f_camf_t *CAMF;
-  camf_entry_t *table;
-  int i;
+  camf_entry_t *entry = find_camf_entry(x3f, list);
 
-  if (!DE) {
-    x3f_printf(DEBUG, "Could not get entry %s: CAMF section not found\n",
-	       list);
-    return 0;
-  }
+  if (!entry) return 0;
 
-  DEH = &DE->header;
-  CAMF = &DEH->data_subsection.camf;
-  table = CAMF->entry_table.element;
-
-  for (i=0; i<CAMF->entry_table.size; i++) {
-    camf_entry_t *entry = &table[i];
-
-    if (!strcmp(list, entry->name_address)) {
-      if (entry->id != X3F_CMbP) {
-	x3f_printf(DEBUG, "CAMF entry is not a property list: %s\n", list);
-	return 0;
-      }
-
-      x3f_printf(DEBUG, "Getting CAMF property list for %s\n", list);
-      *names = entry->property_name;
-      *values = (char **)entry->property_value;
-      *num = entry->property_num;
-      return 1;
-    }
+  if (entry->id != X3F_CMbP) {
+    x3f_printf(DEBUG, "CAMF entry is not a property list: %s\n", list);
+    return 0;
   }
 
-  x3f_printf(DEBUG, "CAMF entry not found: %s\n", list);
-
-  return 0;
+  x3f_printf(DEBUG, "Getting CAMF property list for %s\n", list);
+  *names = entry->property_name;
+  *values = (char **)entry->property_value;
+  *num = entry->property_num;
+  return 1;
 }
 
 /* extern */ int x3f_get_camf_property(x3f_t *x3f, char *list,
 				       char *name, char **value)
 {
-  char **names, **values;
-  uint32_t num, i;
+  camf_entry_t *entry = find_camf_entry(x3f, list);
+  int i;
 
-  if (!x3f_get_camf_property_list(x3f, list, &names, &values, &num))
-    return 0;
+  if (!entry) return 0;
 
-  for (i=0; i<num; i++)
-    if (!strcmp(names[i], name)) {
-	*value = values[i];
-	return 1;
-    }
+  if (entry->id != X3F_CMbP) {
+    x3f_printf(DEBUG, "CAMF entry is not a property list: %s\n", list);
+    return 0;
+  }
 
-  x3f_printf(DEBUG, "CAMF property '%s' not found in list '%s'\n", name, list);
+  i = x3f_find_name(&entry->property_index, name);
+  if (i < 0) {
+    x3f_printf(DEBUG, "CAMF property '%s' not found in list '%s'\n",
+	       name, list);
+    return 0;
+  }
 
-  return 0;
+  *value = (char *)entry->property_value[i];
+  return 1;
 }
 
 /* extern */ int x3f_get_prop_entry(x3f_t *x3f, char *name, char **value)
@@ -296,7 +236,7 @@
   x3f_directory_entry_t *DE = x3f_get_prop(x3f);
   x3f_directory_entry_header_t *DEH;
   x3f_property_list_t *PL;
-  x3f_property_t *table;
+  x3f_property_t *entry;
   int i;
 
   if (!DE) {
@@ -307,22 +247,18 @@
 
   DEH = &DE->header;
   PL = &DEH->data_subsection.property_list;
-  table = PL->property_table.element;
-
-  for (i=0; i<PL->property_table.size; i++) {
-    x3f_property_t *entry = &table[i];
 
-    if (!strcmp(name, entry->name_utf8)) {
-      x3f_printf(DEBUG, "Getting PROP entry \"%s\" = \"%s\"\n",
-		 name, entry->value_utf8);
-      *value = entry->value_utf8;
-      return 1;
-    }
+  i = x3f_find_name(&PL->property_index, name);
+  if (i < 0) {
+    x3f_printf(DEBUG, "PROP entry not found: %s\n", name);
+    return 0;
   }
 
-  x3f_printf(DEBUG, "PROP entry not found: %s\n", name);
-
-  return 0;
+  entry = &PL->property_table.element[i];
+  x3f_printf(DEBUG, "Getting PROP entry \"%s\" = \"%s\"\n",
+	     name, entry->value_utf8);
+  *value = entry->value_utf8;
+  return 1;
 }
 
 /* extern */ char *x3f_get_wb(x3f_t *x3f)
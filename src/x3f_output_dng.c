@@ -308,6 +308,7 @@ x3f_return_t x3f_dump_raw_data_as_dng(x3f_t *x3f,
   x3f_area16_t image;
   x3f_image_levels_t ilevels;
   x3f_area8_t preview;
+  uint16_t *row_buf;
   int row;
 
   if (fd == -1) return X3F_OUTFILE_ERROR;
@@ -417,8 +418,19 @@ x3f_return_t x3f_dump_raw_data_as_dng(x3f_t *x3f,
   if (get_camf_rect_as_dngrect(x3f, "ActiveImageArea", &image, 1, active_area))
     TIFFSetField(f_out, TIFFTAG_ACTIVEAREA, active_area);
 
+  /* A planar image is interleaved row by row */
+  row_buf = NULL;
+  if (image.plane_stride != 0 &&
+      NULL == (row_buf = (uint16_t *)
+	       malloc(image.columns*image.channels*sizeof(uint16_t)))) {
+    TIFFClose(f_out);
+    free(image.buf);
+    free(preview.buf);
+    return X3F_INTERNAL_ERROR;
+  }
   for (row=0; row < image.rows; row++)
-    TIFFWriteScanline(f_out, image.data + image.row_stride*row, row, 0);
+    TIFFWriteScanline(f_out, x3f_area_row(&image, row, row_buf), row, 0);
+  free(row_buf);
 
   TIFFWriteDirectory(f_out);
   TIFFClose(f_out);
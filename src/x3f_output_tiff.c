@@ -9,6 +9,7 @@
 
 #include "x3f_output_tiff.h"
 #include "x3f_process.h"
+#include "x3f_image.h"
 
 #include <stdlib.h>
 #include <tiffio.h>
@@ -26,6 +27,7 @@ x3f_return_t x3f_dump_raw_data_as_tiff(x3f_t *x3f,
 {
   x3f_area16_t image;
   TIFF *f_out = TIFFOpen(outfilename, "w");
+  uint16_t *row_buf;
   int row;
 
   if (f_out == NULL) return X3F_OUTFILE_ERROR;
@@ -52,8 +54,18 @@ x3f_return_t x3f_dump_raw_data_as_tiff(x3f_t *x3f,
   TIFFSetField(f_out, TIFFTAG_YRESOLUTION, 72.0);
   TIFFSetField(f_out, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
 
+  /* A planar image is interleaved row by row */
+  row_buf = NULL;
+  if (image.plane_stride != 0 &&
+      NULL == (row_buf = (uint16_t *)
+	       malloc(image.columns*image.channels*sizeof(uint16_t)))) {
+    TIFFClose(f_out);
+    free(image.buf);
+    return X3F_INTERNAL_ERROR;
+  }
   for (row=0; row < image.rows; row++)
-    TIFFWriteScanline(f_out, image.data + image.row_stride*row, row, 0);
+    TIFFWriteScanline(f_out, x3f_area_row(&image, row, row_buf), row, 0);
+  free(row_buf);
 
   TIFFWriteDirectory(f_out);
   TIFFClose(f_out);
@@ -48,22 +48,25 @@ static char *id_to_str(uint32_t id)
   return buf;
 }
 
-static void print_matrix_element(FILE *f_out, camf_entry_t *entry, uint32_t i)
+static void print_matrix_element(FILE *f_out, x3f_t *x3f,
+				 camf_entry_t *entry, uint32_t i)
 {
+  void *decoded = x3f_get_camf_matrix_decoded(x3f, entry);
+
   switch (entry->matrix_decoded_type) {
   case M_FLOAT:
-    fprintf(f_out, "%12g ", ((double *)(entry->matrix_decoded))[i]);
+    fprintf(f_out, "%12g ", ((double *)decoded)[i]);
     break;
   case M_INT:
-    fprintf(f_out, "%12d ", ((int32_t *)(entry->matrix_decoded))[i]);
+    fprintf(f_out, "%12d ", ((int32_t *)decoded)[i]);
     break;
   case M_UINT:
-    fprintf(f_out, "%12d ", ((uint32_t *)(entry->matrix_decoded))[i]);
+    fprintf(f_out, "%12d ", ((uint32_t *)decoded)[i]);
     break;
   }
 }
 
-static void print_matrix(FILE *f_out, camf_entry_t *entry)
+static void print_matrix(FILE *f_out, x3f_t *x3f, camf_entry_t *entry)
 {
   uint32_t dim = entry->matrix_dim;
   uint32_t linesize = entry->matrix_dim_entry[dim-1].size;
@@ -111,7 +114,7 @@ static void print_matrix(FILE *f_out, camf_entry_t *entry)
   }
 
   for (i=0; i<totalsize; i++) {
-    print_matrix_element(f_out, entry, i);
+    print_matrix_element(f_out, x3f, entry, i);
     if ((i+1)%linesize == 0) fprintf(f_out, "\n");
     if ((i+1)%blocksize == 0) fprintf(f_out, "\n");
     if (i >= (max_printed_matrix_elements-1)) {
@@ -161,7 +164,7 @@ static void print_file_header_meta_data(FILE *f_out, x3f_t *x3f)
   fprintf(f_out, "END: file header meta data\n\n");
 }
 
-static void print_camf_meta_data2(FILE *f_out, x3f_camf_t *CAMF)
+static void print_camf_meta_data2(FILE *f_out, x3f_t *x3f, x3f_camf_t *CAMF)
 {
   fprintf(f_out, "BEGIN: CAMF meta data\n\n");
 
@@ -232,7 +235,7 @@ static void print_camf_meta_data2(FILE *f_out, x3f_camf_t *CAMF)
 	  fprintf(f_out, "            matrix_estimated_element_size = %g\n", entry[i].matrix_estimated_element_size);
 	}
 
-	print_matrix(f_out, &entry[i]);
+	print_matrix(f_out, x3f, &entry[i]);
 
 	fprintf(f_out, "END: CAMF matrix meta data\n\n");
       }
@@ -254,7 +257,7 @@ static void print_camf_meta_data(FILE *f_out, x3f_t *x3f)
   x3f_directory_entry_header_t *DEH = &DE->header;
   x3f_camf_t *CAMF = &DEH->data_subsection.camf;
 
-  print_camf_meta_data2(f_out, CAMF);
+  print_camf_meta_data2(f_out, x3f, CAMF);
 }
 
 static void print_prop_meta_data2(FILE *f_out, x3f_property_list_t *PL)
@@ -479,7 +482,7 @@ static void print_prop_meta_data(FILE *f_out, x3f_t *x3f)
       printf("        entry_table      = %x %p\n",
 	     CAMF->entry_table.size, CAMF->entry_table.element);
 
-      print_camf_meta_data2(stdout, CAMF);
+      print_camf_meta_data2(stdout, x3f, CAMF);
     }
   }
 }
@@ -506,3 +509,29 @@ static void print_prop_meta_data(FILE *f_out, x3f_t *x3f)
 
   return X3F_OK;
 }
+
+/* One line per file, with tab separated fields: name, version,
+   columns, rows, rotation, white balance, RAW type_format and size,
+   and the sections as ID:size, with type_format and size for
+   images */
+/* extern */ void x3f_print_probe(FILE *f_out, char *name, x3f_probe_t *P)
+{
+  uint32_t d;
+
+  fprintf(f_out, "%s\t%08x\t%u\t%u\t%u\t%s\t%08x\t%ux%u\t",
+	  name, P->version, P->columns, P->rows, P->rotation,
+	  P->white_balance[0] ? P->white_balance : "-",
+	  P->raw_type_format, P->raw_columns, P->raw_rows);
+
+  for (d=0; d<P->num_sections && d<X3F_PROBE_MAX_SECTIONS; d++) {
+    x3f_probe_section_t *S = &P->section[d];
+
+    fprintf(f_out, "%s%s:%u", d ? "," : "", x3f_id(S->type), S->size);
+    if (S->type == X3F_SECi)
+      fprintf(f_out, ":%08x:%ux%u", S->type_format, S->columns, S->rows);
+  }
+  if (P->num_sections > X3F_PROBE_MAX_SECTIONS)
+    fprintf(f_out, ",+%u", P->num_sections - X3F_PROBE_MAX_SECTIONS);
+
+  fprintf(f_out, "\n");
+}
@@ -32,8 +32,7 @@ static int sum_area(x3f_area16_t area, int colors,
   for (row = 0; row < area.rows; row++)
     for (col = 0; col < area.columns; col++)
       for (color = 0; color < colors; color++)
-	sum[color] += (uint64_t)area.data[area.row_stride*row +
-					  area.channels*col + color];
+	sum[color] += (uint64_t)X3F_AREA_PIXEL(&area, row, col, color);
 
   return area.columns*area.rows;
 }
@@ -48,35 +47,32 @@ static int sum_area_sqdev(x3f_area16_t area, int colors, double *mean,
   for (row = 0; row < area.rows; row++)
     for (col = 0; col < area.columns; col++)
       for (color = 0; color < colors; color++) {
-	double dev = area.data[area.row_stride*row +
-			       area.channels*col + color] - mean[color];
+	double dev = X3F_AREA_PIXEL(&area, row, col, color) - mean[color];
 	sum[color] += dev*dev;
       }
 
   return area.columns*area.rows;
 }
 
-static int get_black_level(x3f_t *x3f,
-			   x3f_area16_t *image, int rescale, int colors,
-			   double *black_level, double *black_dev)
-{
-  uint64_t *black, *black_sum;
-  double *black_sqdev, *black_sqdev_sum;
-  int pixels_sum, i;
+#define BLACK_AREAS 4
 
-  col_side_t side[4] = {COL_SIDE_WRONG,
-			COL_SIDE_WRONG,
-			COL_SIDE_LEFT,
-			COL_SIDE_RIGHT};
-  char *name[4] = {"DarkShieldTop",
-		   "DarkShieldBottom",
-		   "Left", /* Only used in printout */
-		   "Right" /* Only used in printout */
-  };
-  int use[4] = {1, 1, 1, 1};
-  x3f_area16_t area[4];
+static char *black_name[BLACK_AREAS] = {"DarkShieldTop",
+					"DarkShieldBottom",
+					"Left", /* Only used in printout */
+					"Right" /* Only used in printout */
+};
 
-  if (image->channels < colors) return 0;
+/* The rects of image that the black level is calculated from */
+static void get_black_rects(x3f_t *x3f, x3f_area16_t *image, int rescale,
+			    int *use, uint32_t (*rect)[4])
+{
+  col_side_t side[BLACK_AREAS] = {COL_SIDE_WRONG,
+				  COL_SIDE_WRONG,
+				  COL_SIDE_LEFT,
+				  COL_SIDE_RIGHT};
+  int i;
+
+  for (i=0; i<BLACK_AREAS; i++) use[i] = 1;
 
 #define BOTTOM 1
 
@@ -103,18 +99,90 @@ static int get_black_level(x3f_t *x3f,
   /* Real CAMF rects */
   for (i=0; i<2; i++)
     if (use[i])
-      use[i] = x3f_crop_area_camf(x3f, name[i], image, rescale, &area[i]);
+      use[i] = x3f_get_camf_rect(x3f, black_name[i], image, rescale, rect[i]);
 
   /* Column based rects */
   for (i=2; i<4; i++)
     if (use[i])
-      use[i] = x3f_crop_area_column(x3f, side[i], image, rescale, &area[i]);
+      use[i] = x3f_get_column_rect(x3f, side[i], image, rescale, rect[i]);
+}
 
-  for (i=0; i<4; i++)
-    if (use[i])
-      x3f_printf(DEBUG, "Calculate black level for %s\n", name[i]);
+/* The statistics of rect, if collected while decoding */
+static x3f_rect_stats_t *find_rect_stats(x3f_area_stats_t *AS, uint32_t *rect)
+{
+  uint32_t r;
+
+  if (AS == NULL) return NULL;
+
+  for (r=0; r<AS->num_rects; r++)
+    if (!memcmp(AS->rect[r].rect, rect, 4*sizeof(uint32_t)))
+      return &AS->rect[r];
+
+  return NULL;
+}
+
+static void add_black_rects(x3f_t *x3f, x3f_area16_t *image, int rescale,
+			    x3f_area_stats_t *AS)
+{
+  uint32_t rect[BLACK_AREAS][4];
+  int use[BLACK_AREAS], i;
+
+  get_black_rects(x3f, image, rescale, use, rect);
+
+  for (i=0; i<BLACK_AREAS; i++)
+    if (use[i] && AS->num_rects < X3F_STATS_MAX_RECTS)
+      memcpy(AS->rect[AS->num_rects++].rect, rect[i], 4*sizeof(uint32_t));
+}
+
+static int black_stats_setup(void *data, x3f_image_stats_t *S,
+			     x3f_area16_t *x3rgb16, x3f_area16_t *top16)
+{
+  x3f_t *x3f = (x3f_t *)data;
+
+  add_black_rects(x3f, x3rgb16, 1, &S->x3rgb16);
+  if (top16 != NULL)
+    add_black_rects(x3f, top16, 0, &S->top16);
+
+  return S->x3rgb16.num_rects > 0 || S->top16.num_rects > 0;
+}
+
+/* extern */ x3f_return_t x3f_collect_black_level(x3f_t *x3f)
+{
+  return x3f_collect_stats(x3f, x3f_get_raw(x3f), black_stats_setup, x3f);
+}
+
+/* AS is the statistics collected while decoding image, or NULL. The
+   mean of rects not found there, and the deviation of all rects, are
+   summed up here. */
+static int get_black_level(x3f_t *x3f,
+			   x3f_area16_t *image, int rescale, int colors,
+			   x3f_area_stats_t *AS,
+			   double *black_level, double *black_dev)
+{
+  uint64_t *black, *black_sum;
+  double *black_sqdev, *black_sqdev_sum;
+  int pixels_sum, i;
+
+  int use[BLACK_AREAS];
+  uint32_t rect[BLACK_AREAS][4];
+  x3f_rect_stats_t *stats[BLACK_AREAS];
+  x3f_area16_t area[BLACK_AREAS];
+
+  if (image->channels < colors) return 0;
+
+  get_black_rects(x3f, image, rescale, use, rect);
+
+  for (i=0; i<BLACK_AREAS; i++)
+    if (use[i]) {
+      x3f_printf(DEBUG, "Calculate black level for %s\n", black_name[i]);
+      stats[i] = find_rect_stats(AS, rect[i]);
+      /* This should not fail as long as x3f_get_camf_rect and
+	 x3f_get_column_rect are implemented correctly */
+      assert(x3f_crop_area(rect[i], image, &area[i]));
+    }
     else
-      x3f_printf(DEBUG, "Do not calculate black level for %s\n", name[i]);
+      x3f_printf(DEBUG, "Do not calculate black level for %s\n",
+		 black_name[i]);
 
   pixels_sum = 0;
   black = alloca(colors*sizeof(uint64_t));
@@ -123,14 +191,22 @@ static int get_black_level(x3f_t *x3f,
 
   x3f_printf(DEBUG, "Dark level\n");
 
-  for (i=0; i<4; i++)
+  for (i=0; i<BLACK_AREAS; i++)
     if (use[i]) {
       int color;
-      int pixels = sum_area(area[i], colors, black);
+      int pixels;
+
+      if (stats[i] != NULL) {
+	pixels = stats[i]->pixels;
+	for (color = 0; color < colors; color++)
+	  black[color] = stats[i]->sum[color];
+      } else
+	pixels = sum_area(area[i], colors, black);
 
       pixels_sum += pixels;
 
-      x3f_printf(DEBUG, "  %s (%d)\n", name[i], pixels);
+      x3f_printf(DEBUG, "  %s (%d)%s\n", black_name[i], pixels,
+		 stats[i] != NULL ? " from decoding" : "");
 
       for (color = 0; color < colors; color++) {
 	x3f_printf(DEBUG, "    mean[%d] = %f\n",
@@ -150,10 +226,15 @@ static int get_black_level(x3f_t *x3f,
   black_sqdev_sum = alloca(colors*sizeof(double));
   for (i=0; i<colors; i++) black_sqdev_sum[i] = 0.0;
 
-  for (i=0; i<4; i++)
+  for (i=0; i<BLACK_AREAS; i++)
     if (use[i]) {
       int color;
-      int pixels = sum_area_sqdev(area[i], colors, black_level, black_sqdev);
+      int pixels;
+
+      /* Always summed up directly, as the result from the sums of
+	 value and value^2 is not rounded the same way. The dark areas
+	 are small. */
+      pixels = sum_area_sqdev(area[i], colors, black_level, black_sqdev);
 
       pixels_sum += pixels;
 
@@ -492,24 +573,19 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
 
     /* Iterate over all pixels in the bad pixel list, in this pass */
     for (p=bad_pixel_list; p && (pn=p->next, 1); p=pn) {
-      uint16_t *outp =
-	&image->data[p->r*image->row_stride + p->c*image->channels];
+      uint16_t *outp = &X3F_AREA_PIXEL(image, p->r, p->c, 0);
       uint16_t *inp[4] = {NULL, NULL, NULL, NULL};
       int num = 0;
 
       /* Collect status of neighbor pixels */
       if (!TEST_PIX(bad_pixel_vec, p->c - 1, p->r, image->columns, image->rows))
-	num++, inp[0] =
-	  &image->data[p->r*image->row_stride + (p->c - 1)*image->channels];
+	num++, inp[0] = &X3F_AREA_PIXEL(image, p->r, p->c - 1, 0);
       if (!TEST_PIX(bad_pixel_vec, p->c + 1, p->r, image->columns, image->rows))
-	num++, inp[1] =
-	  &image->data[p->r*image->row_stride + (p->c + 1)*image->channels];
+	num++, inp[1] = &X3F_AREA_PIXEL(image, p->r, p->c + 1, 0);
       if (!TEST_PIX(bad_pixel_vec, p->c, p->r - 1, image->columns, image->rows))
-	num++, inp[2] =
-	  &image->data[(p->r - 1)*image->row_stride + p->c*image->channels];
+	num++, inp[2] = &X3F_AREA_PIXEL(image, p->r - 1, p->c, 0);
       if (!TEST_PIX(bad_pixel_vec, p->c, p->r + 1, image->columns, image->rows))
-	num++, inp[3] =
-	  &image->data[(p->r + 1)*image->row_stride + p->c*image->channels];
+	num++, inp[3] = &X3F_AREA_PIXEL(image, p->r + 1, p->c, 0);
 
       /* Test if interpolation is possible ... */
       if (inp[0] && inp[1] && inp[2] && inp[3])
@@ -533,8 +609,8 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
       for (color=0; color < colors; color++) {
 	uint32_t sum = 0;
 	for (i=0; i<4; i++)
-	  if (inp[i]) sum += inp[i][color];
-	outp[color] = (sum + num/2)/num;
+	  if (inp[i]) sum += inp[i][X3F_CHANNEL_STRIDE(image)*color];
+	outp[X3F_CHANNEL_STRIDE(image)*color] = (sum + num/2)/num;
       }
 
       /* Remove p from bad_pixel_list */
@@ -581,22 +657,56 @@ static void interpolate_bad_pixels(x3f_t *x3f, x3f_area16_t *image, int colors)
   free(bad_pixel_vec);
 }
 
+/* The statistics collected while decoding, if they are still valid */
+static x3f_image_stats_t *get_image_stats(x3f_t *x3f)
+{
+  x3f_directory_entry_t *DE = x3f_get_raw(x3f);
+  x3f_image_stats_t *S;
+
+  if (DE == NULL) return NULL;
+
+  S = DE->header.data_subsection.image_data.stats;
+  return S != NULL && S->collected ? S : NULL;
+}
+
+/* Table of the scaled and clamped intermediate value, for each RAW
+   value of one color */
+static void get_linear_lut(uint16_t *lut, double scale, double black_level,
+			   double intermediate_black)
+{
+  int val;
+
+  for (val = 0; val < 65536; val++) {
+    int32_t out =
+      (int32_t)round(scale * (val - black_level) + intermediate_black);
+
+    if (out < 0) lut[val] = 0;
+    else if (out > 65535) lut[val] = 65535;
+    else lut[val] = out;
+  }
+}
+
 static int preprocess_data(x3f_t *x3f, int fix_bad, char *wb, x3f_image_levels_t *ilevels)
 {
   x3f_area16_t image, qtop;
   int row, col, color;
   uint32_t max_raw[3];
   double scale[3], black_level[3], black_dev[3], intermediate_bias;
+  uint16_t *lut;
   int quattro = x3f_image_area_qtop(x3f, &qtop);
   int colors_in = quattro ? 2 : 3;
+  x3f_image_stats_t *S = get_image_stats(x3f);
 
   if (!x3f_image_area(x3f, &image) || image.channels < 3) return 0;
   if (quattro && (qtop.channels < 1 ||
 		  qtop.rows < 2*image.rows || qtop.columns < 2*image.columns))
     return 0;
 
-  if (!get_black_level(x3f, &image, 1, colors_in, black_level, black_dev) ||
+  if (!get_black_level(x3f, &image, 1, colors_in,
+		       S != NULL ? &S->x3rgb16 : NULL,
+		       black_level, black_dev) ||
       (quattro && !get_black_level(x3f, &qtop, 0, 1,
+				   S != NULL ? &S->top16 : NULL,
 				   &black_level[2], &black_dev[2]))) {
     x3f_printf(ERR, "Could not get black level\n");
     return 0;
@@ -631,55 +741,76 @@ static int preprocess_data(x3f_t *x3f, int fix_bad, char *wb, x3f_image_levels_t
     scale[color] = (ilevels->white[color] - ilevels->black[color]) /
       (max_raw[color] - black_level[color]);
 
-  /* Preprocess image data (HUF/TRU->x3rgb16) */
-  for (row = 0; row < image.rows; row++)
-    for (col = 0; col < image.columns; col++)
+  if (NULL == (lut = malloc(3*65536*sizeof(uint16_t)))) {
+    x3f_printf(ERR, "Could not allocate linearization table\n");
+    return 0;
+  }
+  for (color = 0; color < 3; color++)
+    get_linear_lut(&lut[65536*color], scale[color], black_level[color],
+		   ilevels->black[color]);
+
+  /* The image data is changed in place below */
+  if (S != NULL) S->collected = 0;
+
+  /* Preprocess image data (HUF/TRU->x3rgb16). For Quattro, the two
+     rows of the top layer (Q->top16) covering each image row are
+     downsampled into the image and then preprocessed at full
+     resolution, in the same pass. */
+  for (row = 0; row < image.rows; row++) {
+    uint16_t *valp = &X3F_AREA_PIXEL(&image, row, 0, 0);
+
+    for (col = 0; col < image.columns; col++) {
       for (color = 0; color < colors_in; color++) {
-	uint16_t *valp =
-	  &image.data[image.row_stride*row + image.channels*col + color];
-	int32_t out =
-	  (int32_t)round(scale[color] * (*valp - black_level[color]) +
-			 ilevels->black[color]);
-
-	if (out < 0) *valp = 0;
-	else if (out > 65535) *valp = 65535;
-	else *valp = out;
+	uint16_t *p = &valp[X3F_CHANNEL_STRIDE(&image)*color];
+
+	*p = lut[65536*color + *p];
       }
+      valp += X3F_PIXEL_STRIDE(&image);
+    }
+
+    if (quattro) {
+      uint16_t *row1 = &qtop.data[qtop.row_stride*2*row];
+      uint16_t *row2 = &qtop.data[qtop.row_stride*(2*row+1)];
 
-  if (quattro) {
-    /* Preprocess and downsample Quattro top layer (Q->top16) */
-    for (row = 0; row < image.rows; row++)
       for (col = 0; col < image.columns; col++) {
-	uint16_t *outp =
-	  &image.data[image.row_stride*row + image.channels*col + 2];
-	uint16_t *row1 =
-	  &qtop.data[qtop.row_stride*2*row + qtop.channels*2*col];
-	uint16_t *row2 =
-	  &qtop.data[qtop.row_stride*(2*row+1) + qtop.channels*2*col];
-	uint32_t sum =
-	  row1[0] + row1[qtop.channels] + row2[0] + row2[qtop.channels];
+	uint16_t *outp = &X3F_AREA_PIXEL(&image, row, col, 2);
+	uint16_t *p1 = &row1[qtop.channels*2*col];
+	uint16_t *p2 = &row2[qtop.channels*2*col];
+	uint32_t sum = p1[0] + p1[qtop.channels] + p2[0] + p2[qtop.channels];
 	int32_t out = (int32_t)round(scale[2] * (sum/4.0 - black_level[2]) +
 				     ilevels->black[2]);
 
 	if (out < 0) *outp = 0;
 	else if (out > 65535) *outp = 65535;
 	else *outp = out;
+
+	p1[0] = lut[2*65536 + p1[0]];
+	p1[qtop.channels] = lut[2*65536 + p1[qtop.channels]];
+	p2[0] = lut[2*65536 + p2[0]];
+	p2[qtop.channels] = lut[2*65536 + p2[qtop.channels]];
       }
 
-    /* Preprocess Quattro top layer (Q->top16) at full resolution */
-    for (row = 0; row < qtop.rows; row++)
+      /* Any top layer columns to the right of the downsampled ones */
+      for (col = 2*image.columns; col < qtop.columns; col++) {
+	row1[qtop.channels*col] = lut[2*65536 + row1[qtop.channels*col]];
+	row2[qtop.channels*col] = lut[2*65536 + row2[qtop.channels*col]];
+      }
+    }
+  }
+
+  if (quattro) {
+    /* Any top layer rows below the downsampled ones */
+    for (row = 2*image.rows; row < qtop.rows; row++)
       for (col = 0; col < qtop.columns; col++) {
 	uint16_t *valp = &qtop.data[qtop.row_stride*row + qtop.channels*col];
-	int32_t out = (int32_t)round(scale[2] * (*valp - black_level[2]) +
-				     ilevels->black[2]);
 
-	if (out < 0) *valp = 0;
-	else if (out > 65535) *valp = 65535;
-	else *valp = out;
+	*valp = lut[2*65536 + *valp];
       }
     if (fix_bad) interpolate_bad_pixels(x3f, &qtop, 1);
   }
 
+  free(lut);
+
   if (fix_bad) interpolate_bad_pixels(x3f, &image, 3);
 
   return 1;
@@ -785,8 +916,7 @@ static int convert_data(x3f_t *x3f,
 
       /* Get the data */
       for (color = 0; color < 3; color++) {
-	valp[color] =
-	  &image->data[image->row_stride*row + image->channels*col + color];
+	valp[color] = &X3F_AREA_PIXEL(image, row, col, color);
 	input[color] = x3f_calc_spatial_gain(sgain, sgain_num,
 					     row, col, color,
 					     image->rows, image->columns) *
@@ -854,6 +984,7 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
   expanded->rows = qtop_crop.rows;
   expanded->channels = 3;
   expanded->row_stride = expanded->columns*expanded->channels;
+  expanded->plane_stride = 0;
   expanded->data = expanded->buf =
     malloc(expanded->rows*expanded->row_stride*sizeof(uint16_t));
 
@@ -879,14 +1010,12 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
 			       int apply_sgain,
 			       char *wb)
 {
-  x3f_area16_t original_image, expanded;
+  x3f_area16_t original_image, expanded, qtop;
   x3f_image_levels_t il;
 
   if (wb == NULL) wb = x3f_get_wb(x3f);
 
   if (encoding == QTOP) {
-    x3f_area16_t qtop;
-
     if (!x3f_image_area_qtop(x3f, &qtop)) return 0;
     if (!crop || !x3f_crop_area_camf(x3f, "ActiveImageArea", &qtop, 0, image))
       *image = qtop;
@@ -894,6 +1023,14 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
     return ilevels == NULL;
   }
 
+  /* Denoising and Quattro expansion only handle interleaved data. A
+     planar image is then copied to an interleaved buffer, which makes
+     planar decoding a loss on that path. */
+  if (encoding != UNPROCESSED &&
+      (denoise || x3f_image_area_qtop(x3f, &qtop)) &&
+      !x3f_image_area_interleave(x3f))
+    return 0;
+
   if (!x3f_image_area(x3f, &original_image)) return 0;
   if (!crop || !x3f_crop_area_camf(x3f, "ActiveImageArea", &original_image, 1,
 				   image))
@@ -974,8 +1111,8 @@ static int expand_quattro(x3f_t *x3f, int denoise, x3f_area16_t *expanded)
 
 	for (r=0; r<reduction; r++)
 	  for (c=0; c<reduction; c++)
-	    acc += image->data[image->row_stride*(row*reduction + r) +
-			       image->channels*(col*reduction + c) + color];
+	    acc += X3F_AREA_PIXEL(image, row*reduction + r,
+				  col*reduction + c, color);
 
 	input[color] = x3f_calc_spatial_gain(sgain, sgain_num,
 					     row, col, color,
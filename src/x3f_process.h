@@ -26,6 +26,13 @@ typedef struct {
   uint32_t white[3];
 } x3f_image_levels_t;
 
+/* Collect the sums of the dark areas while the RAW data is decoded,
+   so that the black level does not need to read them afterwards. The
+   deviation is still summed up from the dark areas, to get exactly
+   the same result. Call it before loading the RAW data, but after
+   CAMF. */
+extern x3f_return_t x3f_collect_black_level(x3f_t *x3f);
+
 extern int x3f_get_gain(x3f_t *x3f, char *wb, double *gain);
 extern int x3f_get_bmt_to_xyz(x3f_t *x3f, char *wb, double *bmt_to_xyz);
 extern int x3f_get_raw_to_xyz(x3f_t *x3f, char *wb, double *raw_to_xyz);
@@ -0,0 +1,147 @@
+/* X3F_THREAD.C
+ *
+ * Library for running independent jobs in parallel.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#include "x3f_thread.h"
+#include "x3f_printf.h"
+
+#include <stdlib.h>
+
+#if defined(_WIN32) || defined (_WIN64)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* extern */ int x3f_max_threads = 0;
+
+#define MAX_THREADS 64
+
+typedef struct job_queue_s {
+  x3f_job_t job;
+  void *data;
+  int jobs;
+#if defined(_WIN32) || defined (_WIN64)
+  volatile LONG next;
+#else
+  int next;
+  pthread_mutex_t lock;
+#endif
+} job_queue_t;
+
+static int get_next_job(job_queue_t *Q)
+{
+#if defined(_WIN32) || defined (_WIN64)
+  return InterlockedIncrement(&Q->next) - 1;
+#else
+  int next;
+
+  pthread_mutex_lock(&Q->lock);
+  next = Q->next++;
+  pthread_mutex_unlock(&Q->lock);
+
+  return next;
+#endif
+}
+
+static void run_queue(job_queue_t *Q)
+{
+  int job;
+
+  while ((job = get_next_job(Q)) < Q->jobs)
+    Q->job(Q->data, job);
+}
+
+#if defined(_WIN32) || defined (_WIN64)
+static DWORD WINAPI worker(LPVOID arg)
+{
+  run_queue((job_queue_t *)arg);
+  return 0;
+}
+#else
+static void *worker(void *arg)
+{
+  run_queue((job_queue_t *)arg);
+  return NULL;
+}
+#endif
+
+static int num_cpus(void)
+{
+#if defined(_WIN32) || defined (_WIN64)
+  SYSTEM_INFO info;
+
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return n > 0 ? n : 1;
+#endif
+}
+
+/* extern */ void x3f_run_jobs(int jobs, x3f_job_t job, void *data)
+{
+  job_queue_t Q;
+  int threads = x3f_max_threads > 0 ? x3f_max_threads : num_cpus();
+  int started = 0;
+  int i;
+#if defined(_WIN32) || defined (_WIN64)
+  HANDLE thread[MAX_THREADS];
+#else
+  pthread_t thread[MAX_THREADS];
+#endif
+
+  if (threads > jobs) threads = jobs;
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+  if (threads <= 1) {
+    for (i=0; i<jobs; i++)
+      job(data, i);
+    return;
+  }
+
+  Q.job = job;
+  Q.data = data;
+  Q.jobs = jobs;
+  Q.next = 0;
+#if !defined(_WIN32) && !defined (_WIN64)
+  pthread_mutex_init(&Q.lock, NULL);
+#endif
+
+  /* The calling thread is one of the workers. If a thread cannot be
+     started, the others just get more jobs. */
+  for (i=0; i<threads-1; i++) {
+#if defined(_WIN32) || defined (_WIN64)
+    thread[started] = CreateThread(NULL, 0, worker, &Q, 0, NULL);
+    if (thread[started] == NULL) {
+#else
+    if (pthread_create(&thread[started], NULL, worker, &Q) != 0) {
+#endif
+      x3f_printf(DEBUG, "Could not start thread %d\n", i);
+      break;
+    }
+    started++;
+  }
+
+  run_queue(&Q);
+
+  for (i=0; i<started; i++) {
+#if defined(_WIN32) || defined (_WIN64)
+    WaitForSingleObject(thread[i], INFINITE);
+    CloseHandle(thread[i]);
+#else
+    pthread_join(thread[i], NULL);
+#endif
+  }
+
+#if !defined(_WIN32) && !defined (_WIN64)
+  pthread_mutex_destroy(&Q.lock);
+#endif
+}
@@ -0,0 +1,32 @@
+/* X3F_THREAD.H
+ *
+ * Library for running independent jobs in parallel.
+ *
+ * Copyright 2015 - Roland and Erik Karlsson
+ * BSD-style - see doc/copyright.txt
+ *
+ */
+
+#ifndef X3F_THREAD_H
+#define X3F_THREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Max number of threads. 0 means one per CPU and 1 means that all
+   jobs are run in the calling thread. */
+extern int x3f_max_threads;
+
+typedef void (*x3f_job_t)(void *data, int job);
+
+/* Run job(data, 0) ... job(data, jobs-1) and wait for all of them to
+   finish. The jobs may run in any order and must not depend on each
+   other. */
+extern void x3f_run_jobs(int jobs, x3f_job_t job, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif